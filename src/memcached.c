@@ -6,11 +6,16 @@
 
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <math.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/socket.h>
@@ -40,6 +45,24 @@
 #define MEMCACHED_TYPE_TABLE64       LUA_TTABLE + 32 + 16
 #define MEMCACHED_TYPE_TABLEREF      LUA_TTABLE + 64
 #define MEMCACHED_CODEC_VERSION  "LM\xf6\x02"  /* version 2 */
+#define MEMCACHED_CODEC_RECORD   "LM\xf6\x82"  /* version 2, record framing */
+#define MEMCACHED_CODEC_PATCH    "LM\xf6\x42"  /* version 2, patch framing */
+#define MEMCACHED_DIFF_DEPTH     32             /* maximum diff and patch depth */
+#define MEMCACHED_SORT_SMALL     16             /* maximum records sorted by insertion sort */
+
+/* item flags */
+#define MEMCACHED_FLAG_ENVELOPE  1  /* value is followed by an envelope */
+
+/* envelope */
+#define MEMCACHED_ENVELOPE_SIZE  16          /* created (8), TTL (4), delta (4) */
+#define MEMCACHED_TTL_MAX        2592000     /* 30 days; larger values are absolute */
+
+/* keys */
+#define MEMCACHED_KEY_MAX        250  /* maximum key length supported by memcached */
+#define MEMCACHED_KEY_HASH       32   /* hashed key suffix length (hex) */
+#define MEMCACHED_PREFIX_MAX     128  /* maximum key prefix length */
+#define MEMCACHED_NAMESPACE_MAX  128  /* maximum namespace name length */
+#define MEMCACHED_KEY_IOVCNT     3    /* maximum key segments */
 
 /* response flags */
 #define MEMCACHED_EXTRAS        1
@@ -62,24 +85,287 @@
 		((sizeof(((protocol_binary_request_flush *)0)->bytes)) - MEMCACHED_REQUEST_BASE)
 #define MEMCACHED_REQUEST_STATS_EXTRAS  \
 		((sizeof(((protocol_binary_request_stats *)0)->bytes)) - MEMCACHED_REQUEST_BASE)
-
+#define MEMCACHED_REQUEST_TOUCH_EXTRAS  \
+		((sizeof(((protocol_binary_request_touch *)0)->bytes)) - MEMCACHED_REQUEST_BASE)
+
+/* pipelines */
+#define MEMCACHED_OP_IOVCNT        (1 + MEMCACHED_KEY_IOVCNT + 2)  /* maximum op segments */
+#define MEMCACHED_PIPELINE_IOVCNT  (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#define MEMCACHED_INPUT_MIN        65536  /* minimum read-ahead size */
+#define MEMCACHED_OPAQUE_NOOP      UINT32_MAX  /* opaque of the terminating no-op */
+#define MEMCACHED_OPAQUE_ASYNC     0x80000000  /* opaque flag of queued writes */
+#define MEMCACHED_SEQ_MASK         0x7fffffff  /* queued write sequence mask */
+#define MEMCACHED_PENDING_MAX      4096        /* maximum unacknowledged queued writes */
+#define MEMCACHED_STATUS_NONE      UINT16_MAX  /* no response */
+#define MEMCACHED_CONCAT_PASSES    4           /* append or prepend passes */
+#define MEMCACHED_BATCH_CHUNK      1024        /* maximum batch operations per round trip */
+
+/* rate limits */
+#define MEMCACHED_RATELIMITS  4096  /* maximum cached rate limits */
+
+/* metrics */
+#define MEMCACHED_METRIC_GET         0
+#define MEMCACHED_METRIC_SET         1
+#define MEMCACHED_METRIC_INC         2
+#define MEMCACHED_METRIC_TOUCH       3
+#define MEMCACHED_METRIC_MULTI       4
+#define MEMCACHED_METRIC_OPS         5
+#define MEMCACHED_PHASE_TOTAL        0
+#define MEMCACHED_PHASE_NETWORK      1    /* connect, send, server wait, and receive */
+#define MEMCACHED_PHASE_CODEC        2    /* encode and decode */
+#define MEMCACHED_PHASES             3
+#define MEMCACHED_HISTOGRAM_SUB      4    /* linear sub-buckets per power of two */
+#define MEMCACHED_HISTOGRAM_BUCKETS  144  /* up to 2^37 ns, i.e., about 137 s */
+#define MEMCACHED_TALLY_SENT         0    /* bytes sent */
+#define MEMCACHED_TALLY_RECEIVED     1    /* bytes received */
+#define MEMCACHED_TALLY_SENDS        2    /* send system calls */
+#define MEMCACHED_TALLY_RECVS        3    /* receive system calls */
+#define MEMCACHED_TALLY_CONNECTS     4    /* connects */
+#define MEMCACHED_TALLY_RECONNECTS   5    /* connects after the first */
+#define MEMCACHED_TALLY_HITS         6    /* gets of present keys */
+#define MEMCACHED_TALLY_MISSES       7    /* gets of missing keys */
+#define MEMCACHED_TALLY_STATUS       8    /* responses by error status (256 slots) */
+#define MEMCACHED_TALLIES            (MEMCACHED_TALLY_STATUS + 256)
+#define MEMCACHED_TOTALS             "memcached.totals"  /* registry field of module totals */
+#define MEMCACHED_SLOW_KEY           64   /* maximum key length in slow operations */
+#define MEMCACHED_SKETCH_DEPTH       4     /* Count-Min sketch rows */
+#define MEMCACHED_SKETCH_WIDTH       2048  /* Count-Min sketch columns (power of two) */
+#define MEMCACHED_HOTKEYS_MAX        1024  /* maximum tracked hot keys */
+#define MEMCACHED_HOTKEYS_INDEX      2048  /* hot key index slots (power of two) */
+#define MEMCACHED_SIZE_GROUPS        64    /* maximum key prefixes with tracked value sizes */
+#define MEMCACHED_SIZE_PREFIX        32    /* maximum key prefix length of value sizes */
+
+
+typedef struct histogram {
+	uint64_t  count;                                 /* recorded values */
+	uint64_t  sum;                                   /* sum of values (ns) */
+	uint64_t  max;                                   /* maximum value (ns) */
+	uint64_t  buckets[MEMCACHED_HISTOGRAM_BUCKETS];  /* log-linear buckets */
+} histogram_t;
+
+typedef struct metrics {
+	histogram_t  latency[MEMCACHED_METRIC_OPS][MEMCACHED_PHASES];  /* latency by op and phase */
+} metrics_t;
+
+typedef struct optimer {
+	uint64_t  start;     /* operation start (ns) */
+	uint64_t  codec;     /* codec time at operation start (ns) */
+	uint64_t  sent;      /* bytes sent at operation start */
+	uint64_t  received;  /* bytes received at operation start */
+} optimer_t;
+
+typedef struct slowop {
+	int       op;                              /* operation type */
+	uint64_t  time;                            /* completion (milliseconds since the epoch) */
+	uint64_t  value[MEMCACHED_PHASES];         /* time by phase (ns) */
+	uint64_t  sent;                            /* bytes sent */
+	uint64_t  received;                        /* bytes received */
+	size_t    keylen;                          /* key length */
+	char      key[MEMCACHED_SLOW_KEY];         /* key, truncated */
+} slowop_t;
+
+typedef struct hotkey {
+	uint64_t  hash;                    /* key hash */
+	uint64_t  count;                   /* estimated count */
+	size_t    keylen;                  /* key length */
+	char      key[MEMCACHED_KEY_MAX];  /* key, truncated */
+} hotkey_t;
+
+typedef struct sizegroup {
+	uint64_t  count;                          /* values */
+	uint64_t  bytes;                          /* total value size */
+	uint64_t  max;                            /* maximum value size */
+	size_t    prefixlen;                      /* key prefix length */
+	char      prefix[MEMCACHED_SIZE_PREFIX];  /* key prefix */
+} sizegroup_t;
+
+typedef struct sketch {
+	uint32_t     counts[MEMCACHED_SKETCH_DEPTH][MEMCACHED_SKETCH_WIDTH];  /* Count-Min sketch */
+	sizegroup_t  groups[MEMCACHED_SIZE_GROUPS];  /* value sizes by key prefix */
+	int          ngroups;                        /* value sizes count */
+	int          k;                              /* hot keys capacity */
+	int          n;                              /* hot keys count */
+	int16_t      index[MEMCACHED_HOTKEYS_INDEX]; /* hot key slot + 1 by key hash, or 0 */
+	hotkey_t     top[];                          /* hot keys (min-heap by count) */
+} sketch_t;
 
 typedef struct memcached {
-	int  host_index;    /* network host (string) */
-	int  port_index;    /* network port/service (string) */
-	int  encode_index;  /* encode function */
-	int  decode_index;  /* decode function */
-	int  timeout;       /* connect timeout (milliseconds) */
-	int  fd;            /* socket */
-	int  reconnect:1;   /* reconnect on error */
-	int  closed:1;      /* closed */
+	int          host_index;       /* network host (string) */
+	int          port_index;       /* network port/service (string) */
+	int          encode_index;     /* encode function */
+	int          decode_index;     /* decode function */
+	int          prefix_index;     /* key prefix (string) */
+	int          counters_index;   /* counters (weak table) */
+	int          ratelimits_index; /* rate limit cache (table) */
+	int          ratelimitcount;   /* rate limit cache count */
+	int          deltas_index;     /* delta base CAS values and encodings by key (table) */
+	int          deltas;           /* delta base cache size (bytes), or 0 if disabled */
+	size_t       deltasize;        /* delta base cache used size (bytes) */
+	int          dedup_index;      /* recent writes by key (table) */
+	int          dedup;            /* recent writes size, or 0 if disabled */
+	int          dedupcount;       /* recent writes count */
+	int          pending_index;    /* keys of queued writes by sequence (table) */
+	int          errors_index;     /* failed queued writes (table) */
+	int          prefetch_index;   /* prefetch with unread responses (reference) */
+	metrics_t   *metrics;          /* metrics, or NULL */
+	sketch_t    *sketch;           /* hot keys and value sizes, or NULL */
+	uint64_t     codec;            /* codec time (ns) */
+	uint64_t     slow;             /* slow operation threshold (ns), or 0 if disabled */
+	int          slowhandler_index; /* slow operation handler (function) */
+	slowop_t    *slowlog;          /* slow operations (ring), or NULL */
+	int          slowlogsize;      /* slow operations capacity */
+	int          slowloghead;      /* next slow operation */
+	int          slowlogcount;     /* slow operations count */
+	uint64_t    *totals;           /* module totals */
+	uint64_t     tally[MEMCACHED_TALLIES];  /* counters */
+	char        *queue;            /* queued write requests */
+	size_t       queuelen;         /* queued write requests length */
+	size_t       queuecap;         /* queued write requests capacity */
+	int          queuelimit;       /* queued write requests limit (bytes) */
+	uint32_t     seq;              /* last queued write */
+	uint32_t     sent;             /* last sent queued write */
+	uint32_t     acked;            /* last completed queued write */
+	const char  *prefix;           /* key prefix */
+	size_t       prefixlen;        /* key prefix length */
+	int          timeout;          /* connect timeout (milliseconds) */
+	int          fd;               /* socket */
+	char        *input;            /* responses read ahead while sending */
+	size_t       inputpos;         /* read-ahead position */
+	size_t       inputlen;         /* read-ahead length */
+	size_t       inputcap;         /* read-ahead capacity */
+	int          keylimit;         /* key length limit for hashing, or 0 if disabled */
+	double       xfetch;           /* XFetch beta, or 0 if disabled */
+	double       jitter;           /* relative TTL jitter, or 0 if disabled */
+	uint64_t     random;           /* pseudo-random state */
+	int          keycheck:1;       /* reject keys with whitespace and control characters */
+	int          canonical:1;      /* encode in canonical order */
+	int          reconnect:1;      /* reconnect on error */
+	int          closed:1;         /* closed */
+	int          timed:1;          /* time operations, for metrics or slow operations */
 } memcached_t;
 
+typedef struct namespace {
+	int       memcached_index;                       /* memcached instance */
+	int       ttl;                                   /* generation cache time (milliseconds) */
+	uint64_t  expires;                               /* generation cache expiry (milliseconds) */
+	uint64_t  generation;                            /* cached generation */
+	size_t    namelen;                               /* name length */
+	size_t    prefixlen;                             /* key prefix length */
+	char      name[MEMCACHED_NAMESPACE_MAX + 4];     /* name, followed by ':gen' */
+	char      prefix[MEMCACHED_NAMESPACE_MAX + 22];  /* key prefix, 'name:generation:' */
+} namespace_t;
+
+typedef struct counter {
+	int          memcached_index;  /* memcached instance */
+	int          key_index;        /* key (string) */
+	int          interval;         /* flush interval (milliseconds), or 0 */
+	lua_Integer  threshold;        /* flush threshold (absolute pending delta), or 0 */
+	lua_Integer  expiration;       /* expiration */
+	lua_Integer  pending;          /* pending delta */
+	lua_Integer  value;            /* last known value */
+	uint64_t     flushed;          /* last flush (milliseconds) */
+	int          known;            /* whether the value is known */
+} counter_t;
+
+typedef struct ratelimit {
+	lua_Integer  length;  /* window length (seconds) */
+	lua_Integer  window;  /* window number */
+	lua_Integer  count;   /* server count, as of the last exchange */
+	lua_Integer  tokens;  /* locally leased tokens */
+} ratelimit_t;
+
+typedef struct shardedcounter {
+	int          memcached_index;  /* memcached instance */
+	int          keys_index;       /* shard keys (table) */
+	int          n;                /* number of shards */
+	lua_Integer  expiration;       /* expiration */
+} shardedcounter_t;
+
+typedef struct lock {
+	int       memcached_index;  /* memcached instance */
+	int       key_index;        /* key (string) */
+	uint64_t  cas;              /* CAS of the lock item, i.e., fencing token */
+	int       held;             /* held */
+} lock_t;
+
+typedef struct list {
+	int          memcached_index;  /* memcached instance */
+	int          key_index;        /* key (string) */
+	int          sizekey_index;    /* size counter key (string) */
+	lua_Integer  limit;            /* maximum records kept by compaction */
+	size_t       threshold;        /* compaction threshold (bytes) */
+	lua_Integer  expiration;       /* expiration */
+} list_t;
+
+typedef struct mkey {
+	const char  *prefix;     /* instance prefix */
+	size_t       prefixlen;  /* instance prefix length */
+	const char  *ns;         /* namespace prefix, or NULL */
+	size_t       nslen;      /* namespace prefix length */
+	const char  *key;        /* key */
+	size_t       keylen;     /* key length */
+	size_t       len;        /* total length */
+	char         buf[MEMCACHED_KEY_MAX + 1];  /* hashed key */
+} mkey_t;
+
+typedef union request {
+	protocol_binary_request_header  header;
+	protocol_binary_request_get     get;
+	protocol_binary_request_set     set;
+	protocol_binary_request_incr    incr;
+	protocol_binary_request_touch   touch;
+} request_t;
+
+typedef struct op {
+	request_t    request;     /* request header and extras */
+	size_t       requestlen;  /* request header and extras length */
+	mkey_t       k;           /* key */
+	const char  *value;       /* value, or NULL */
+	size_t       valuelen;    /* value length */
+	uint16_t     status;      /* response status */
+	uint64_t     cas;         /* response CAS */
+	uint64_t     number;      /* response number, such as an incremented value */
+} op_t;
+
 typedef struct backref {
 	int          index;
 	lua_Integer  cnt;
+	int          canonical;  /* encode records in canonical order */
 } backref_t;
 
+typedef struct sortkey {
+	uint64_t      key;        /* radix key, ordered by type rank and value prefix */
+	int           rank;       /* type rank */
+	int           pos;        /* position in the keys table */
+	int           isinteger;  /* integer number */
+	lua_Integer   i;          /* boolean or integer value */
+	lua_Number    d;          /* number value */
+	const char   *s;          /* string value */
+	size_t        len;        /* string length */
+} sortkey_t;
+
+typedef struct batch {
+	memcached_t  *m;          /* memcached instance */
+	mkey_t        k;          /* base key, including the namespace */
+	int           ops_index;  /* queued operations (table) */
+	size_t        n;          /* queued operations count */
+	int           done;       /* executed or abandoned */
+} batch_t;
+
+typedef struct loader {
+	int     memcached_index;  /* memcached instance or namespace (reference) */
+	int     pending_index;    /* pending requests (table) */
+	size_t  n;                /* pending requests count */
+} loader_t;
+
+typedef struct prefetch {
+	int     memcached_index;  /* memcached instance or namespace (reference) */
+	int     keys_index;       /* keys (table) */
+	int     values_index;     /* values by key (table) */
+	size_t  n;                /* keys count */
+	int     done;             /* responses read */
+} prefetch_t;
+
 
 /* buffer */
 static int buffer_require(lua_State *L, memcached_buffer_t *b, size_t cnt);
@@ -90,30 +376,125 @@ static int buffer_free(lua_State *L);
 /* codec */
 static inline int supported(lua_State *L, int index);
 static int encode(lua_State *L, memcached_buffer_t *b, backref_t *br, int index);
+static int compare(const sortkey_t *a, const sortkey_t *b);
+static void sortkeys(sortkey_t *keys, sortkey_t *tmp, size_t n);
+static int encodesorted(lua_State *L, memcached_buffer_t *b, backref_t *br, int index,
+		int64_t *narr, int64_t *nrec);
 static int decode(lua_State *L, memcached_buffer_t *b, backref_t *br);
 static int decodetable(lua_State *L, memcached_buffer_t *b, backref_t *br, int64_t narr,
 		int64_t nrec);
+static int applypatch(lua_State *L, int tindex, int pindex, int depth);
+static int encodeframe(lua_State *L, int index, const char *version, int canonical);
+static int decodeencoding(lua_State *L, memcached_buffer_t *b, size_t *snapshot);
 static int mencode(lua_State *L);
+static int decoderecords(lua_State *L, memcached_buffer_t *b);
 static int mdecode(lua_State *L);
+static void envelope(char *e, lua_Integer ttl, lua_Number delta);
+static int xfetch(lua_State *L, memcached_t *m, memcached_buffer_t *b);
 
 /* network */
 static int getsocket(lua_State *L, memcached_t *m);
+static void disconnect(lua_State *L, memcached_t *m);
 static ssize_t checkresult(lua_State *L, memcached_t *m, ssize_t result);
+static int protocolerror(lua_State *L, memcached_t *m);
 static ssize_t sendnosig(lua_State *L, memcached_t *m, const void *buf, size_t len);
-static ssize_t sendmsgnosig(lua_State *L, memcached_t *m, const struct iovec *iov, int iovcnt);
+static ssize_t sendmsgnosig(lua_State *L, memcached_t *m, const struct iovec *iov, int iovcnt,
+		int flags);
 static int recvnosig(lua_State *L, memcached_t *m, void *buf, size_t len);
+static int recvahead(lua_State *L, memcached_t *m);
 static int recvstring(lua_State *L, memcached_t *m, size_t len);
+static int sendqueued(lua_State *L, memcached_t *m);
+static int syncqueued(lua_State *L, memcached_t *m);
+static int queuederror(lua_State *L, memcached_t *m, uint32_t opaque, uint16_t status);
+static int lostqueued(lua_State *L, memcached_t *m);
+static int ackqueued(lua_State *L, memcached_t *m);
+static int sendiov(lua_State *L, memcached_t *m, struct iovec *iov, int iovcnt);
+static int sendops(lua_State *L, memcached_t *m, op_t *ops, size_t n);
+static void opinit(op_t *op, uint8_t opcode, uint8_t extlen, size_t valuelen, uint32_t opaque);
+
+/* metrics */
+static uint64_t clockns(void);
+static int bucket(uint64_t value);
+static uint64_t bucketlimit(int index);
+static size_t copykey(mkey_t *k, char *buf, size_t max);
+static void opstart(memcached_t *m, optimer_t *t);
+static void opend(lua_State *L, memcached_t *m, int op, mkey_t *k, optimer_t *t);
+static void slowop(lua_State *L, memcached_t *m, int op, mkey_t *k, optimer_t *t,
+		const uint64_t *value);
+static void pushslowop(lua_State *L, const slowop_t *e);
+static int hotindex(sketch_t *sk, uint64_t hash);
+static void hotremove(sketch_t *sk, int i);
+static void hotswap(sketch_t *sk, int i, int j);
+static void siftdown(sketch_t *sk, int i);
+static void siftup(sketch_t *sk, int i);
+static void track(memcached_t *m, mkey_t *k, int64_t size);
+static int comparehotkeys(const void *a, const void *b);
+static int hotkeys(lua_State *L);
+static int sizereport(lua_State *L);
+static int slowlog(lua_State *L);
+static void pushhistogram(lua_State *L, histogram_t *h);
+static inline void tally(memcached_t *m, int index, uint64_t n);
+static void pushtallies(lua_State *L, const uint64_t *tally);
+static int metrics(lua_State *L);
+static int mmetrics(lua_State *L);
+static void addline(lua_State *L, const char *fmt, ...);
+static int prometheus(lua_State *L);
 
 /* main */
 static int getstring(lua_State *L, int index, const char *field, const char *dflt);
 static int getfunction(lua_State *L, int index, const char *field, lua_CFunction dflt);
 static int getint(lua_State *L, int index, const char *field, int dflt);
 static int getboolean(lua_State *L, int index, const char *field, int dflt);
+static lua_Number getnumber(lua_State *L, int index, const char *field, lua_Number dflt);
+static uint64_t clockms(clockid_t clock);
+static double random01(memcached_t *m);
 static int mopen(lua_State *L);
-static int recvresponse(lua_State *L, memcached_t *m, uint16_t *status, uint64_t *cas, int flags);
+static lua_Integer checkexpiration(lua_State *L, memcached_t *m, int index, lua_Integer *ttl);
+static memcached_t *checkmemcached(lua_State *L, int index, mkey_t *k);
+static int checkkey(lua_State *L, memcached_t *m, int index, mkey_t *k);
+static int validkey(const char *key, size_t len);
+static inline uint64_t rotl64(uint64_t x, int r);
+static inline uint64_t fmix64(uint64_t k);
+static void hashkey(const char *key, size_t len, uint64_t *h1, uint64_t *h2);
+static int keyiov(mkey_t *k, struct iovec *iov);
+static int recvresponse(lua_State *L, memcached_t *m, uint16_t *status, uint64_t *cas,
+		uint32_t *opaque, int flags);
 static int backoff(lua_State *L, int min, int max, int* result);
+static int retrywait(lua_State *L, int *backoff_ms);
+static int encodevalue(lua_State *L, memcached_t *m, int index, int record, const char **value,
+		size_t *valuelen);
+static int fetch(lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration, uint64_t *cas,
+		int *refresh);
+static int decodeitem(lua_State *L, memcached_t *m, int nret);
+static int touchkey(lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration,
+		uint16_t *status, uint64_t *cas, int timed);
+static void pushkey(lua_State *L, mkey_t *k);
+static void dedupwrite(lua_State *L, memcached_t *m, int index, uint64_t hash, uint64_t cas);
+static int store(lua_State *L, memcached_t *m, uint8_t opcode, mkey_t *k, int index,
+		lua_Integer expiration, lua_Integer ttl, lua_Number delta, uint64_t *cas,
+		uint16_t *status);
+static int increment(lua_State *L, memcached_t *m, uint8_t opcode, mkey_t *k, lua_Integer delta,
+		lua_Integer initial, lua_Integer expiration, uint16_t *status, uint64_t *value);
 static int get(lua_State *L);
 static int set(lua_State *L);
+static int setasync(lua_State *L);
+static int flushpending(lua_State *L);
+static int gat(lua_State *L);
+static int touch(lua_State *L);
+static int touchmulti(lua_State *L);
+static int update(lua_State *L);
+static int incmulti(lua_State *L);
+static int same(lua_State *L, int index1, int index2);
+static int diff(lua_State *L, int oindex, int nindex, int depth);
+static int defaultcodec(lua_State *L, memcached_t *m);
+static void cachedelta(lua_State *L, memcached_t *m, mkey_t *k, uint64_t cas, int index);
+static int setdelta(lua_State *L);
+static size_t concat(lua_State *L, memcached_t *m, op_t *ops, size_t n, uint8_t opcode,
+		lua_Integer expiration);
+static int append(lua_State *L);
+static int appendmulti(lua_State *L);
+static void pruneratelimits(lua_State *L, memcached_t *m);
+static int ratelimit(lua_State *L);
 static int incr(lua_State *L);
 static int flush(lua_State *L);
 static int stats(lua_State *L);
@@ -121,11 +502,87 @@ static int quit(lua_State *L);
 static int mclose(lua_State *L);
 static int tostring(lua_State *L);
 
+/* namespace */
+static int generation(lua_State *L, memcached_t *m, namespace_t *ns, lua_Integer delta);
+static int mnamespace(lua_State *L);
+static int invalidate(lua_State *L);
+static int namespace_free(lua_State *L);
+static int namespace_tostring(lua_State *L);
+
+/* counter */
+static int flushcounters(lua_State *L, memcached_t *m);
+static int flushall(lua_State *L);
+static int mcounter(lua_State *L);
+static int counter_inc(lua_State *L);
+static int counter_get(lua_State *L);
+static int counter_flush(lua_State *L);
+static int counter_free(lua_State *L);
+static int counter_tostring(lua_State *L);
+
+/* sharded counter */
+static int mshardedcounter(lua_State *L);
+static int shardedcounter_inc(lua_State *L);
+static int shardedcounter_get(lua_State *L);
+static int shardedcounter_free(lua_State *L);
+static int shardedcounter_tostring(lua_State *L);
+
+/* lock */
+static int acquire(lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration,
+		uint64_t *cas, uint16_t *status);
+static int mlock(lua_State *L);
+static int lock_token(lua_State *L);
+static int lock_release(lua_State *L);
+static int lock_free(lua_State *L);
+static int lock_tostring(lua_State *L);
+
+/* list */
+static memcached_t *listkey(lua_State *L, list_t *l, int index, mkey_t *k);
+static int setlistsize(lua_State *L, list_t *l, size_t size);
+static int compact(lua_State *L, list_t *l);
+static int mlist(lua_State *L);
+static int list_push(lua_State *L);
+static int list_range(lua_State *L);
+static int list_compact(lua_State *L);
+static int list_free(lua_State *L);
+static int list_tostring(lua_State *L);
+
+/* batch */
+static int mbatch(lua_State *L);
+static int batch_op(lua_State *L);
+static int batch_free(lua_State *L);
+static int batch_tostring(lua_State *L);
+
+/* loader */
+static int dispatch(lua_State *L, loader_t *l);
+static int mloader(lua_State *L);
+static int loader_get(lua_State *L);
+static int loader_getk(lua_State *L, int status, lua_KContext ctx);
+static int loader_dispatch(lua_State *L);
+static int loader_free(lua_State *L);
+static int loader_tostring(lua_State *L);
+
+/* prefetch */
+static int drainprefetch(lua_State *L, memcached_t *m);
+static int mprefetch(lua_State *L);
+static int prefetch_result(lua_State *L);
+static int prefetch_free(lua_State *L);
+static int prefetch_tostring(lua_State *L);
+
+
+static const char *const metricops[MEMCACHED_METRIC_OPS] = {
+	"get", "set", "inc", "touch", "multi"
+};
+
+static const char *const metricphases[MEMCACHED_PHASES] = {
+	"total", "network", "codec"
+};
 
 static const luaL_Reg functions[] = {
 	{ "open", mopen },
 	{ "encode", mencode },
 	{ "decode", mdecode },
+	{ "metrics", mmetrics },
+	{ "prometheus", prometheus },
 	{ NULL, NULL }
 };
 
@@ -312,24 +769,28 @@ static int encode (lua_State *L, memcached_buffer_t *b, backref_t *br, int index
 		size_pos = b->pos;
 		b->pos += 2;
 		narr = nrec = 0;
-		lua_pushnil(L);
-		while (lua_next(L, index)) {
-			if (supported(L, -2) && supported(L, -1)) {
-				if (nrec == 0 && lua_tointeger(L, -2) == narr + 1) {
-					if (narr == INT64_MAX) {
-						return luaL_error(L, "too many array elements");
-					}
-					narr++;
-				} else {
-					if (nrec == INT64_MAX) {
-						return luaL_error(L, "too many record elements");
+		if (br->canonical) {
+			encodesorted(L, b, br, index, &narr, &nrec);
+		} else {
+			lua_pushnil(L);
+			while (lua_next(L, index)) {
+				if (supported(L, -2) && supported(L, -1)) {
+					if (nrec == 0 && lua_tointeger(L, -2) == narr + 1) {
+						if (narr == INT64_MAX) {
+							return luaL_error(L, "too many array elements");
+						}
+						narr++;
+					} else {
+						if (nrec == INT64_MAX) {
+							return luaL_error(L, "too many record elements");
+						}
+						nrec++;
 					}
-					nrec++;
-				}
-				encode(L, b, br, lua_gettop(L) - 1);
-				encode(L, b, br, lua_gettop(L));
-			}	
-			lua_pop(L, 1);
+					encode(L, b, br, lua_gettop(L) - 1);
+					encode(L, b, br, lua_gettop(L));
+				}	
+				lua_pop(L, 1);
+			}
 		}
 		if (narr <= UINT8_MAX && nrec <= UINT8_MAX) {
 			b->b[size_pos++] = (char)narr;
@@ -374,6 +835,210 @@ static int encode (lua_State *L, memcached_buffer_t *b, backref_t *br, int index
 	return 0;
 }
 
+static int compare (const sortkey_t *a, const sortkey_t *b) {
+	int  r;
+
+	if (a->rank != b->rank) {
+		return a->rank < b->rank ? -1 : 1;
+	}
+	switch (a->rank) {
+	case 0:  /* boolean */
+		return a->i < b->i ? -1 : a->i > b->i;
+
+	case 1:  /* number */
+		if (a->isinteger && b->isinteger) {
+			return a->i < b->i ? -1 : a->i > b->i;
+		}
+		if (!a->isinteger && !b->isinteger) {
+			return a->d < b->d ? -1 : a->d > b->d;
+		}
+		if (a->d != b->d) {
+			return a->d < b->d ? -1 : 1;
+		}
+
+		/* integer and integral float converting to the same value */
+		if (a->d >= 0x1p63) {
+			return a->isinteger ? -1 : 1;
+		}
+		return a->isinteger ? (a->i < (lua_Integer)b->d ? -1 : a->i > (lua_Integer)b->d)
+				: ((lua_Integer)a->d < b->i ? -1 : (lua_Integer)a->d > b->i);
+
+	case 2:  /* string */
+		r = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+		if (r != 0) {
+			return r < 0 ? -1 : 1;
+		}
+		return a->len < b->len ? -1 : a->len > b->len;
+
+	default:  /* table, in traversal order */
+		return a->pos < b->pos ? -1 : a->pos > b->pos;
+	}
+}
+
+static void sortkeys (sortkey_t *keys, sortkey_t *tmp, size_t n) {
+	int        shift;
+	size_t     i, j, start, counts[256], offset, count;
+	sortkey_t  key, *src, *dst, *swap;
+
+	/* LSD radix sort by the radix key for larger tables */
+	if (n > MEMCACHED_SORT_SMALL) {
+		src = keys;
+		dst = tmp;
+		for (shift = 0; shift < 64; shift += 8) {
+			memset(counts, 0, sizeof(counts));
+			for (i = 0; i < n; i++) {
+				counts[(src[i].key >> shift) & 0xff]++;
+			}
+			offset = 0;
+			for (i = 0; i < 256; i++) {
+				count = counts[i];
+				counts[i] = offset;
+				offset += count;
+			}
+			for (i = 0; i < n; i++) {
+				dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+			}
+			swap = src;
+			src = dst;
+			dst = swap;
+		}
+	}
+
+	/* insertion sort, finishing runs with equal radix keys for larger tables */
+	start = 0;
+	while (start < n) {
+		j = n;
+		if (n > MEMCACHED_SORT_SMALL) {
+			for (j = start + 1; j < n && keys[j].key == keys[start].key; j++);
+		}
+		for (i = start + 1; i < j; i++) {
+			key = keys[i];
+			offset = i;
+			while (offset > start && compare(&keys[offset - 1], &key) > 0) {
+				keys[offset] = keys[offset - 1];
+				offset--;
+			}
+			keys[offset] = key;
+		}
+		start = j;
+	}
+}
+
+static int encodesorted (lua_State *L, memcached_buffer_t *b, backref_t *br, int index,
+		int64_t *narr, int64_t *nrec) {
+	int          keys_index;
+	size_t       n, i, len;
+	uint64_t     u, prefix;
+	sortkey_t   *keys;
+	const char  *s;
+
+	/* encode the array part, in order */
+	luaL_checkstack(L, 4, "encoding table");
+	while (1) {
+		lua_rawgeti(L, index, *narr + 1);
+		if (!supported(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_pushinteger(L, *narr + 1);
+		encode(L, b, br, lua_gettop(L));
+		encode(L, b, br, lua_gettop(L) - 1);
+		lua_pop(L, 2);
+		if (*narr == INT64_MAX) {
+			return luaL_error(L, "too many array elements");
+		}
+		(*narr)++;
+	}
+
+	/* count the record keys; arrays need no sorting */
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (supported(L, -2) && supported(L, -1) && !(lua_isinteger(L, -2)
+				&& lua_tointeger(L, -2) >= 1 && lua_tointeger(L, -2) <= *narr)) {
+			n++;
+		}
+		lua_pop(L, 1);
+	}
+	if (n == 0) {
+		*nrec = 0;
+		return 0;
+	}
+	if (n > INT_MAX) {
+		return luaL_error(L, "too many record elements");
+	}
+
+	/* collect the record keys */
+	lua_createtable(L, (int)n, 0);
+	keys_index = lua_gettop(L);
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (supported(L, -2) && supported(L, -1) && !(lua_isinteger(L, -2)
+				&& lua_tointeger(L, -2) >= 1 && lua_tointeger(L, -2) <= *narr)) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, keys_index, (lua_Integer)++i);
+		}
+		lua_pop(L, 1);
+	}
+
+	/* prepare sort keys, with order-preserving radix keys */
+	keys = lua_newuserdata(L, 2 * n * sizeof(sortkey_t) + 1);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, keys_index, (lua_Integer)i + 1);
+		memset(&keys[i], 0, sizeof(sortkey_t));
+		keys[i].pos = (int)i + 1;
+		switch (lua_type(L, -1)) {
+		case LUA_TBOOLEAN:
+			keys[i].rank = 0;
+			keys[i].i = lua_toboolean(L, -1);
+			keys[i].key = (uint64_t)keys[i].i;
+			break;
+
+		case LUA_TNUMBER:
+			keys[i].rank = 1;
+			keys[i].isinteger = lua_isinteger(L, -1);
+			keys[i].i = keys[i].isinteger ? lua_tointeger(L, -1) : 0;
+			keys[i].d = keys[i].isinteger ? (lua_Number)keys[i].i : lua_tonumber(L, -1);
+			memcpy(&u, &keys[i].d, sizeof(u));
+			u = (u >> 63) ? ~u : u | ((uint64_t)1 << 63);
+			keys[i].key = ((uint64_t)1 << 62) | (u >> 2);
+			break;
+
+		case LUA_TSTRING:
+			keys[i].rank = 2;
+			s = lua_tolstring(L, -1, &len);
+			keys[i].s = s;
+			keys[i].len = len;
+			prefix = 0;
+			for (u = 0; u < 8; u++) {
+				prefix = (prefix << 8) | (u < len ? (uint8_t)s[u] : 0);
+			}
+			keys[i].key = ((uint64_t)2 << 62) | (prefix >> 2);
+			break;
+
+		default:
+			keys[i].rank = 3;
+			keys[i].key = (uint64_t)3 << 62;
+		}
+		lua_pop(L, 1);
+	}
+
+	/* sort, and encode the records in order */
+	sortkeys(keys, &keys[n], n);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, keys_index, keys[i].pos);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, index);
+		encode(L, b, br, lua_gettop(L) - 1);
+		encode(L, b, br, lua_gettop(L));
+		lua_pop(L, 2);
+	}
+	*nrec = (int64_t)n;
+	lua_pop(L, 2);  /* keys table, sort keys */
+	return 0;
+}
+
 static int decode (lua_State *L, memcached_buffer_t *b, backref_t *br) {
 	size_t    len;
 	double    d;
@@ -508,15 +1173,64 @@ static int decodetable (lua_State *L, memcached_buffer_t *b, backref_t *br, int6
 	return 1;
 }
 
-static int mencode (lua_State *L) {
+static int applypatch (lua_State *L, int tindex, int pindex, int depth) {
+	int          index;
+	lua_Integer  i, n;
+
+	/* check patch */
+	luaL_checkstack(L, 4, "applying patch");
+	if (!lua_istable(L, tindex) || !lua_istable(L, pindex) || depth > MEMCACHED_DIFF_DEPTH) {
+		return luaL_error(L, "bad patch");
+	}
+
+	/* set */
+	lua_getfield(L, pindex, "s");
+	if (lua_istable(L, -1)) {
+		index = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, tindex);
+		}
+	}
+	lua_pop(L, 1);
+
+	/* delete */
+	lua_getfield(L, pindex, "d");
+	if (lua_istable(L, -1)) {
+		n = (lua_Integer)lua_rawlen(L, -1);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			lua_pushnil(L);
+			lua_rawset(L, tindex);
+		}
+	}
+	lua_pop(L, 1);
+
+	/* patch nested tables */
+	lua_getfield(L, pindex, "p");
+	if (lua_istable(L, -1)) {
+		index = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, tindex);
+			applypatch(L, lua_gettop(L), lua_gettop(L) - 1, depth + 1);
+			lua_pop(L, 2);
+		}
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+static int encodeframe (lua_State *L, int index, const char *version, int canonical) {
 	backref_t            br;
 	memcached_buffer_t  *b;
 
-	/* check arguments */
-	luaL_checkany(L, 1);
-
 	/* prepare backrefs */
 	br.cnt = 0;
+	br.canonical = canonical;
 	lua_newtable(L);
 	br.index = lua_gettop(L);
 
@@ -533,29 +1247,21 @@ static int mencode (lua_State *L) {
 
 	/* write codec version */
 	buffer_require(L, b, sizeof(MEMCACHED_CODEC_VERSION) - 1);
-	memcpy(&b->b[b->pos], MEMCACHED_CODEC_VERSION, sizeof(MEMCACHED_CODEC_VERSION) - 1);
+	memcpy(&b->b[b->pos], version, sizeof(MEMCACHED_CODEC_VERSION) - 1);
 	b->pos += sizeof(MEMCACHED_CODEC_VERSION) - 1;
 
 	/* encode */
-	encode(L, b, &br, 1);
+	encode(L, b, &br, index);
 	b->len = b->pos;
 
 	/* return buffer */
+	lua_remove(L, br.index);
 	return 1;
 }
 
-static int mdecode (lua_State *L) {
-	backref_t            br;
-	memcached_buffer_t  *b, bs;
-
-	/* check arguments and prepare buffer */
-	b = luaL_testudata(L, 1, MEMCACHED_BUFFER_METATABLE);
-	if (!b) {
-		bs.b = (char *)luaL_checklstring(L, 1, &bs.len);
-		bs.capacity = bs.len;
-		b = &bs;
-	}
-	b->pos = 0;
+static int decodeencoding (lua_State *L, memcached_buffer_t *b, size_t *snapshot) {
+	int        index;
+	backref_t  br;
 
 	/* prepare backrefs */
 	br.cnt = 0;
@@ -564,6 +1270,9 @@ static int mdecode (lua_State *L) {
 
 	/* check codec version */
 	buffer_avail(L, b, sizeof(MEMCACHED_CODEC_VERSION) - 1);
+	if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_RECORD, sizeof(MEMCACHED_CODEC_RECORD) - 1) == 0) {
+		return decoderecords(L, b);
+	}
 	if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_VERSION, sizeof(MEMCACHED_CODEC_VERSION) - 1) != 0) {
 		return luaL_error(L, "bad codec version");
 	}
@@ -571,13 +1280,138 @@ static int mdecode (lua_State *L) {
 
 	/* decode */
 	decode(L, b, &br);
-	if (b->pos < b->len) {
-		return luaL_error(L, "extra data in buffer");
+	index = lua_gettop(L);
+	if (snapshot) {
+		*snapshot = b->pos;
+	}
+
+	/* apply patches, if any */
+	while (b->pos < b->len) {
+		buffer_avail(L, b, sizeof(MEMCACHED_CODEC_PATCH) - 1);
+		if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_RECORD, sizeof(MEMCACHED_CODEC_RECORD) - 1)
+				== 0) {
+			return luaL_error(L, "record concatenated with a value set without record framing");
+		}
+		if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_PATCH, sizeof(MEMCACHED_CODEC_PATCH) - 1)
+				!= 0) {
+			return luaL_error(L, "extra data in buffer");
+		}
+		b->pos += sizeof(MEMCACHED_CODEC_PATCH) - 1;
+		br.cnt = 0;
+		lua_newtable(L);
+		br.index = lua_gettop(L);
+		decode(L, b, &br);
+		applypatch(L, index, lua_gettop(L), 0);
+		lua_pop(L, 2);
 	}
 
 	return 1;
 }
 
+static int mencode (lua_State *L) {
+	/* check arguments */
+	luaL_checkany(L, 1);
+
+	/* encode */
+	return encodeframe(L, 1, lua_toboolean(L, 2) ? MEMCACHED_CODEC_RECORD
+			: MEMCACHED_CODEC_VERSION, lua_toboolean(L, 3));
+}
+
+static int decoderecords (lua_State *L, memcached_buffer_t *b) {
+	int        index;
+	int64_t    n;
+	backref_t  br;
+
+	/* decode a concatenation of records as an array, each record with its own backrefs */
+	lua_newtable(L);
+	index = lua_gettop(L);
+	n = 0;
+	while (b->pos < b->len) {
+		buffer_avail(L, b, sizeof(MEMCACHED_CODEC_RECORD) - 1);
+		if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_VERSION, sizeof(MEMCACHED_CODEC_VERSION) - 1)
+				== 0 || memcmp(&b->b[b->pos], MEMCACHED_CODEC_PATCH,
+				sizeof(MEMCACHED_CODEC_PATCH) - 1) == 0) {
+			return luaL_error(L, "record concatenated with a value set without record framing");
+		}
+		if (memcmp(&b->b[b->pos], MEMCACHED_CODEC_RECORD, sizeof(MEMCACHED_CODEC_RECORD) - 1)
+				!= 0) {
+			return luaL_error(L, "bad record");
+		}
+		b->pos += sizeof(MEMCACHED_CODEC_RECORD) - 1;
+		br.cnt = 0;
+		lua_newtable(L);
+		br.index = lua_gettop(L);
+		decode(L, b, &br);
+		lua_rawseti(L, index, ++n);
+		lua_pop(L, 1);  /* backrefs */
+	}
+	return 1;
+}
+
+static int mdecode (lua_State *L) {
+	memcached_buffer_t  *b, bs;
+
+	/* check arguments and prepare buffer */
+	b = luaL_testudata(L, 1, MEMCACHED_BUFFER_METATABLE);
+	if (!b) {
+		bs.b = (char *)luaL_checklstring(L, 1, &bs.len);
+		bs.capacity = bs.len;
+		b = &bs;
+	}
+	b->pos = 0;
+
+	/* decode */
+	return decodeencoding(L, b, NULL);
+}
+
+static void envelope (char *e, lua_Integer ttl, lua_Number delta) {
+	uint32_t  n32;
+	uint64_t  n64;
+
+	/* creation time (milliseconds since the epoch) */
+	n64 = htobe64(clockms(CLOCK_REALTIME));
+	memcpy(e, &n64, sizeof(n64));
+	e += sizeof(n64);
+
+	/* TTL (seconds) */
+	n32 = htobe32((uint32_t)ttl);
+	memcpy(e, &n32, sizeof(n32));
+	e += sizeof(n32);
+
+	/* recompute cost (milliseconds) */
+	n32 = htobe32(delta < UINT32_MAX / 1000 ? (uint32_t)(delta * 1000) : UINT32_MAX);
+	memcpy(e, &n32, sizeof(n32));
+}
+
+static int xfetch (lua_State *L, memcached_t *m, memcached_buffer_t *b) {
+	uint32_t     ttl, delta;
+	uint64_t     created;
+	const char  *e;
+
+	/* strip envelope */
+	if (b->len < MEMCACHED_ENVELOPE_SIZE) {
+		return luaL_error(L, "bad envelope");
+	}
+	b->len -= MEMCACHED_ENVELOPE_SIZE;
+	b->pos = b->len;
+	e = &b->b[b->len];
+	memcpy(&created, e, sizeof(created));
+	created = be64toh(created);
+	e += sizeof(created);
+	memcpy(&ttl, e, sizeof(ttl));
+	ttl = be32toh(ttl);
+	e += sizeof(ttl);
+	memcpy(&delta, e, sizeof(delta));
+	delta = be32toh(delta);
+
+	/* refresh if now - delta * beta * log(rand()) >= expiry */
+	if (m->xfetch <= 0) {
+		return 0;
+	}
+	return (double)clockms(CLOCK_REALTIME) - delta * m->xfetch * log(random01(m))
+			>= (double)created + ttl * 1000.0;
+}
+
 
 /*
  * network
@@ -595,11 +1429,23 @@ static int getsocket (lua_State *L, memcached_t *m) {
 		return luaL_error(L, "closed");
 	}
 
-	/* nothing to do? */
+	/* nothing to do, other than reading prefetched values and sending queued writes? */
 	if (m->fd >= 0) {
+		if (m->prefetch_index != LUA_NOREF) {
+			drainprefetch(L, m);
+		}
+		if (m->queuelen > 0) {
+			sendqueued(L, m);
+		}
 		return 0;
 	}
 
+	/* the responses of a prefetch are lost with the previous socket */
+	if (m->prefetch_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->prefetch_index);
+		m->prefetch_index = LUA_NOREF;
+	}
+
 	/* resolve */
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
@@ -708,10 +1554,31 @@ static int getsocket (lua_State *L, memcached_t *m) {
 
 	/* store socket */
 	m->fd = fd;
+	if (m->tally[MEMCACHED_TALLY_CONNECTS] > 0) {
+		tally(m, MEMCACHED_TALLY_RECONNECTS, 1);
+	}
+	tally(m, MEMCACHED_TALLY_CONNECTS, 1);
+
+	/* send queued writes */
+	if (m->queuelen > 0) {
+		sendqueued(L, m);
+	}
 
 	return 0;
 }
 
+static void disconnect (lua_State *L, memcached_t *m) {
+	/* close the socket, discarding its responses read ahead */
+	close(m->fd);
+	m->fd = -1;
+	m->inputpos = m->inputlen = 0;
+
+	/* the queued writes in flight are lost */
+	if (!m->closed && m->acked != m->sent) {
+		lostqueued(L, m);
+	}
+}
+
 static ssize_t checkresult (lua_State *L, memcached_t *m, ssize_t result) {
 	int  err;
 
@@ -719,12 +1586,11 @@ static ssize_t checkresult (lua_State *L, memcached_t *m, ssize_t result) {
 		return result;
 	}
 	err = errno;
-	if (result < 0 && err == EINTR) {
-		/* interrupted by signal, try again */
+	if (result < 0 && (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)) {
+		/* interrupted by signal, or would block; try again */
 		return 0;
 	}
-	close(m->fd);
-	m->fd = -1;
+	disconnect(L, m);
 	if (!m->reconnect) {
 		m->closed = 1;
 	}
@@ -735,29 +1601,98 @@ static ssize_t checkresult (lua_State *L, memcached_t *m, ssize_t result) {
 	}
 }
 
+static int protocolerror (lua_State *L, memcached_t *m) {
+	/* the responses cannot be matched to requests anymore */
+	disconnect(L, m);
+	if (!m->reconnect) {
+		m->closed = 1;
+	}
+	return luaL_error(L, "protocol error");
+}
+
 static ssize_t sendnosig (lua_State *L , memcached_t *m, const void *buf, size_t len) {
-	return checkresult(L, m, send(m->fd, buf, len, MSG_NOSIGNAL));
+	ssize_t  result;
+
+	result = checkresult(L, m, send(m->fd, buf, len, MSG_NOSIGNAL));
+	tally(m, MEMCACHED_TALLY_SENDS, 1);
+	tally(m, MEMCACHED_TALLY_SENT, (uint64_t)result);
+	return result;
 }
 
-static ssize_t sendmsgnosig (lua_State *L, memcached_t *m, const struct iovec *iov, int iovcnt) {
+static ssize_t sendmsgnosig (lua_State *L, memcached_t *m, const struct iovec *iov, int iovcnt,
+		int flags) {
+	ssize_t        result;
 	struct msghdr  msg;
 
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_iov = (struct iovec *)iov;
 	msg.msg_iovlen = iovcnt;
-	return checkresult(L, m, sendmsg(m->fd, &msg, MSG_NOSIGNAL));
+	result = checkresult(L, m, sendmsg(m->fd, &msg, MSG_NOSIGNAL | flags));
+	tally(m, MEMCACHED_TALLY_SENDS, 1);
+	tally(m, MEMCACHED_TALLY_SENT, (uint64_t)result);
+	return result;
 }
 
 static int recvnosig (lua_State *L, memcached_t *m, void *buf, size_t len) {
 	char    *b;
+	size_t   n;
 	ssize_t  result;
 
+	/* responses read ahead come first */
 	b = buf;
-	do {
+	if (m->inputpos < m->inputlen) {
+		n = m->inputlen - m->inputpos < len ? m->inputlen - m->inputpos : len;
+		memcpy(b, &m->input[m->inputpos], n);
+		m->inputpos += n;
+		if (m->inputpos == m->inputlen) {
+			/* release large read-aheads once consumed */
+			m->inputpos = m->inputlen = 0;
+			if (m->inputcap > MEMCACHED_INPUT_MIN) {
+				free(m->input);
+				m->input = NULL;
+				m->inputcap = 0;
+			}
+		}
+		b += n;
+		len -= n;
+	}
+	while (len > 0) {
 		result = checkresult(L, m, recv(m->fd, b, len, 0));
+		tally(m, MEMCACHED_TALLY_RECVS, 1);
+		tally(m, MEMCACHED_TALLY_RECEIVED, (uint64_t)result);
 		b += result;
 		len -= result;
-	} while (len > 0);
+	}
+	return 0;
+}
+
+static int recvahead (lua_State *L, memcached_t *m) {
+	char     *input;
+	size_t    cap;
+	ssize_t   result;
+
+	/* compact, or grow */
+	if (m->inputpos > 0) {
+		memmove(m->input, &m->input[m->inputpos], m->inputlen - m->inputpos);
+		m->inputlen -= m->inputpos;
+		m->inputpos = 0;
+	}
+	if (m->inputcap - m->inputlen < MEMCACHED_INPUT_MIN) {
+		cap = m->inputcap > 0 ? m->inputcap * 2 : MEMCACHED_INPUT_MIN;
+		input = realloc(m->input, cap);
+		if (input == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		m->input = input;
+		m->inputcap = cap;
+	}
+
+	/* read what is available */
+	result = checkresult(L, m, recv(m->fd, &m->input[m->inputlen], m->inputcap - m->inputlen,
+			MSG_DONTWAIT));
+	tally(m, MEMCACHED_TALLY_RECVS, 1);
+	tally(m, MEMCACHED_TALLY_RECEIVED, (uint64_t)result);
+	m->inputlen += (size_t)result;
 	return 0;
 }
 
@@ -771,644 +1706,4830 @@ static int recvstring (lua_State *L, memcached_t *m, size_t len) {
 	return 1;
 }
 
+static int sendqueued (lua_State *L, memcached_t *m) {
+	struct iovec  iov;
 
-/*
- * main
-*/
+	/* the queue is emptied first, so a failed send does not resend a partial queue */
+	iov.iov_base = m->queue;
+	iov.iov_len = m->queuelen;
+	m->queuelen = 0;
+	m->sent = m->seq;
+	sendiov(L, m, &iov, 1);
+	return 0;
+}
 
-static int getstring (lua_State *L, int index, const char *field, const char *dflt) {
-	if (lua_isnoneornil(L, index)) {
-		lua_pushstring(L, dflt);
+static int syncqueued (lua_State *L, memcached_t *m) {
+	int                           nret;
+	uint32_t                      opaque;
+	protocol_binary_request_noop  request;
+
+	/* send queued writes, followed by a no-op that flushes their responses */
+	getsocket(L, m);
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+	request.message.header.request.opaque = MEMCACHED_OPAQUE_NOOP;
+	sendnosig(L, m, &request, sizeof(request.bytes));
+	do {
+		nret = recvresponse(L, m, NULL, NULL, &opaque, 0);
+		lua_pop(L, nret);
+	} while (opaque != MEMCACHED_OPAQUE_NOOP);
+	return 0;
+}
+
+static int queuederror (lua_State *L, memcached_t *m, uint32_t opaque, uint16_t status) {
+	/* record the failed write by key */
+	if (m->errors_index == LUA_NOREF) {
+		lua_newtable(L);
+		m->errors_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->errors_index);
+	if (m->pending_index != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->pending_index);
+		lua_rawgeti(L, -1, opaque & MEMCACHED_SEQ_MASK);
+		lua_remove(L, -2);
 	} else {
-		switch (lua_getfield(L, index, field)) {
-		case LUA_TNIL:
-			lua_pop(L, 1);
-			lua_pushstring(L, dflt);
-			break;
+		lua_pushnil(L);
+	}
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushinteger(L, opaque & MEMCACHED_SEQ_MASK);
+	}
+	lua_pushinteger(L, status);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return 0;
+}
 
-		case LUA_TSTRING:
-			break;
+static int lostqueued (lua_State *L, memcached_t *m) {
+	uint32_t  seq;
 
-		case LUA_TNUMBER:
-			lua_tostring(L, -1);
-			break;
+	/* record the queued writes sent without a response as failed */
+	for (seq = m->acked; seq != m->sent; ) {
+		seq = (seq + 1) & MEMCACHED_SEQ_MASK;
+		queuederror(L, m, MEMCACHED_OPAQUE_ASYNC | seq, MEMCACHED_STATUS_NONE);
+	}
+	return ackqueued(L, m);
+}
 
-		default:
-			return luaL_error(L, "bad field '%s' (string expected, got %s)", field,
-						luaL_typename(L, -1));
+static int ackqueued (lua_State *L, memcached_t *m) {
+	/* the queued writes sent before a response are complete */
+	if (m->pending_index != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->pending_index);
+		while (m->acked != m->sent) {
+			m->acked = (m->acked + 1) & MEMCACHED_SEQ_MASK;
+			lua_pushnil(L);
+			lua_rawseti(L, -2, m->acked);
 		}
+		lua_pop(L, 1);
 	}
-	return luaL_ref(L, LUA_REGISTRYINDEX);
+	m->acked = m->sent;
+	return 0;
 }
 
-static int getfunction (lua_State *L, int index, const char *field, lua_CFunction dflt) {
-	if (lua_isnoneornil(L, index)) {
-		lua_pushcfunction(L, dflt);
-	} else {
-		switch (lua_getfield(L, index, field)) {
-		case LUA_TNIL:
-			lua_pop(L, 1);
-			lua_pushcfunction(L, dflt);
-			break;
-
-		case LUA_TFUNCTION:
-			break;
+static int sendiov (lua_State *L, memcached_t *m, struct iovec *iov, int iovcnt) {
+	int            result;
+	size_t         len;
+	struct pollfd  pfd;
+
+	/* send, resuming after partial writes; while the socket is full, responses are read ahead,
+	 * as the server stops reading requests once it cannot write its responses */
+	while (iovcnt > 0) {
+		len = (size_t)sendmsgnosig(L, m, iov, iovcnt, MSG_DONTWAIT);
+		while (iovcnt > 0 && len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+			pfd.fd = m->fd;
+			pfd.events = POLLIN | POLLOUT;
+			result = poll(&pfd, 1, -1);
+			if (result < 0 && errno != EINTR) {
+				return luaL_error(L, "poll error: %s (%d)", strerror(errno), errno);
+			}
+			if (result > 0 && (pfd.revents & POLLIN) && !(pfd.revents & POLLOUT)) {
+				recvahead(L, m);
+			}
+		}
+	}
+	return 0;
+}
 
-		default:
-			return luaL_error(L, "bad field '%s' (function expected, got %s)", field, 
-					luaL_typename(L, -1));
+static void opinit (op_t *op, uint8_t opcode, uint8_t extlen, size_t valuelen, uint32_t opaque) {
+	memset(&op->request, 0, sizeof(op->request));
+	op->request.header.request.magic = PROTOCOL_BINARY_REQ;
+	op->request.header.request.opcode = opcode;
+	op->request.header.request.extlen = extlen;
+	op->request.header.request.keylen = htobe16((uint16_t)op->k.len);
+	op->request.header.request.bodylen = htobe32((uint32_t)(extlen + op->k.len + valuelen));
+	op->request.header.request.opaque = opaque;
+	op->requestlen = MEMCACHED_REQUEST_BASE + extlen;
+	op->value = NULL;
+	op->valuelen = 0;
+	op->status = MEMCACHED_STATUS_NONE;
+	op->cas = op->number = 0;
+}
+
+static int sendops (lua_State *L, memcached_t *m, op_t *ops, size_t n) {
+	int                           iovcnt;
+	size_t                        i;
+	struct iovec                  iov[MEMCACHED_PIPELINE_IOVCNT];
+	protocol_binary_request_noop  noop;
+
+	/* send requests, as few system calls as possible */
+	getsocket(L, m);
+	iovcnt = 0;
+	for (i = 0; i < n; i++) {
+		if (iovcnt > MEMCACHED_PIPELINE_IOVCNT - MEMCACHED_OP_IOVCNT) {
+			sendiov(L, m, iov, iovcnt);
+			iovcnt = 0;
+		}
+		iov[iovcnt].iov_base = &ops[i].request;
+		iov[iovcnt++].iov_len = ops[i].requestlen;
+		iovcnt += keyiov(&ops[i].k, &iov[iovcnt]);
+		if (ops[i].value) {
+			iov[iovcnt].iov_base = (void *)ops[i].value;
+			iov[iovcnt++].iov_len = ops[i].valuelen;
 		}
 	}
-	return luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* terminate with a no-op, which makes the server flush the responses of quiet requests */
+	memset(&noop, 0, sizeof(noop));
+	noop.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	noop.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+	noop.message.header.request.opaque = MEMCACHED_OPAQUE_NOOP;
+	iov[iovcnt].iov_base = &noop;
+	iov[iovcnt++].iov_len = sizeof(noop.bytes);
+	sendiov(L, m, iov, iovcnt);
+	return 0;
 }
 
-static int getint (lua_State *L, int index, const char *field, int dflt) {
-	int          isinteger;
-	lua_Integer  result;
 
-	if (lua_isnoneornil(L, index)) {
-		return dflt;
-	} else {
-		switch (lua_getfield(L, index, field)) {
-		case LUA_TNIL:
-			lua_pop(L, 1);
-			return dflt;
+/*
+ * metrics
+ */
 
-		case LUA_TNUMBER:
-			result = lua_tointegerx(L, -1, &isinteger);
-			if (isinteger && result >= INT_MIN && result <= INT_MAX) {
-				lua_pop(L, 1);
-				return result;
-			}
-			/* fall through */
+static uint64_t clockns (void) {
+	struct timespec  ts;
 
-		default:
-			return luaL_error(L, "bad field '%s' (int expected, got %s)", field,
-					luaL_typename(L, -1));
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket (uint64_t value) {
+	int  e, index;
+
+	/* powers of two, split into linear sub-buckets; small values map to themselves */
+	if (value < MEMCACHED_HISTOGRAM_SUB) {
+		return (int)value;
 	}
+	e = 63 - __builtin_clzll(value);
+	index = (e - 1) * MEMCACHED_HISTOGRAM_SUB + (int)((value >> (e - 2))
+			& (MEMCACHED_HISTOGRAM_SUB - 1));
+	return index < MEMCACHED_HISTOGRAM_BUCKETS ? index : MEMCACHED_HISTOGRAM_BUCKETS - 1;
 }
 
-static int getboolean (lua_State *L, int index, const char *field, int dflt) {
-	int  result;
+static uint64_t bucketlimit (int index) {
+	int  e;
 
-	if (lua_isnoneornil(L, index)) {
-		return dflt;
-	} else {
-		switch (lua_getfield(L, index, field)) {
-		case LUA_TNIL:
-			lua_pop(L, 1);
-			return dflt;
+	/* highest value of a bucket */
+	if (index < MEMCACHED_HISTOGRAM_SUB) {
+		return (uint64_t)index;
+	}
+	e = index / MEMCACHED_HISTOGRAM_SUB + 1;
+	return ((uint64_t)(MEMCACHED_HISTOGRAM_SUB + index % MEMCACHED_HISTOGRAM_SUB + 1)
+			<< (e - 2)) - 1;
+}
 
-		case LUA_TBOOLEAN:
-			result = lua_toboolean(L, -1);
-			lua_pop(L, 1);
-			return result;
+static size_t copykey (mkey_t *k, char *buf, size_t max) {
+	size_t  len, n;
 
-		default:
-			return luaL_error(L, "bad field '%s' (boolean expected, got %s)", field,
-					luaL_typename(L, -1));
+	/* key as sent, truncated */
+	len = 0;
+	n = k->prefixlen < max ? k->prefixlen : max;
+	if (n > 0) {
+		memcpy(buf, k->prefix, n);
+		len += n;
+	}
+	n = k->nslen < max - len ? k->nslen : max - len;
+	if (n > 0) {
+		memcpy(&buf[len], k->ns, n);
+		len += n;
+	}
+	n = k->keylen < max - len ? k->keylen : max - len;
+	if (n > 0) {
+		memcpy(&buf[len], k->key, n);
+		len += n;
+	}
+	return len;
+}
+
+static void opstart (memcached_t *m, optimer_t *t) {
+	if (m->timed) {
+		t->start = clockns();
+		t->codec = m->codec;
+		t->sent = m->tally[MEMCACHED_TALLY_SENT];
+		t->received = m->tally[MEMCACHED_TALLY_RECEIVED];
+	}
+}
+
+static void opend (lua_State *L, memcached_t *m, int op, mkey_t *k, optimer_t *t) {
+	int           i;
+	uint64_t      value[MEMCACHED_PHASES];
+	histogram_t  *h;
+
+	if (!m->timed) {
+		return;
+	}
+	value[MEMCACHED_PHASE_TOTAL] = clockns() - t->start;
+	value[MEMCACHED_PHASE_CODEC] = m->codec - t->codec;
+	value[MEMCACHED_PHASE_NETWORK] = value[MEMCACHED_PHASE_TOTAL] > value[MEMCACHED_PHASE_CODEC]
+			? value[MEMCACHED_PHASE_TOTAL] - value[MEMCACHED_PHASE_CODEC] : 0;
+	if (m->metrics) {
+		for (i = 0; i < MEMCACHED_PHASES; i++) {
+			h = &m->metrics->latency[op][i];
+			h->count++;
+			h->sum += value[i];
+			if (value[i] > h->max) {
+				h->max = value[i];
+			}
+			h->buckets[bucket(value[i])]++;
 		}
 	}
+	if (m->slow > 0 && value[MEMCACHED_PHASE_TOTAL] >= m->slow) {
+		slowop(L, m, op, k, t, value);
+	}
 }
 
-static int mopen (lua_State *L) {
-	memcached_t  *m;
+static void slowop (lua_State *L, memcached_t *m, int op, mkey_t *k, optimer_t *t,
+		const uint64_t *value) {
+	slowop_t  *e, entry;
+
+	/* record into the ring, or pass to the handler */
+	e = m->slowlog ? &m->slowlog[m->slowloghead] : &entry;
+	e->op = op;
+	e->time = clockms(CLOCK_REALTIME);
+	memcpy(e->value, value, sizeof(e->value));
+	e->sent = m->tally[MEMCACHED_TALLY_SENT] - t->sent;
+	e->received = m->tally[MEMCACHED_TALLY_RECEIVED] - t->received;
+	e->keylen = k ? copykey(k, e->key, MEMCACHED_SLOW_KEY) : 0;
+	if (m->slowlog) {
+		m->slowloghead = (m->slowloghead + 1) % m->slowlogsize;
+		if (m->slowlogcount < m->slowlogsize) {
+			m->slowlogcount++;
+		}
+		return;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->slowhandler_index);
+	pushslowop(L, e);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		/* ignore error, if any */
+		lua_pop(L, 1);
+	}
+}
 
-	/* check arguments */
-	if (!lua_isnoneornil(L, 1)) {
-		luaL_checktype(L, 1, LUA_TTABLE);
+static void pushslowop (lua_State *L, const slowop_t *e) {
+	int  i;
+
+	lua_createtable(L, 0, 8);
+	lua_pushstring(L, metricops[e->op]);
+	lua_setfield(L, -2, "op");
+	if (e->keylen > 0) {
+		lua_pushlstring(L, e->key, e->keylen);
+		lua_setfield(L, -2, "key");
 	}
+	lua_pushinteger(L, (lua_Integer)e->sent);
+	lua_setfield(L, -2, "request");
+	lua_pushinteger(L, (lua_Integer)e->received);
+	lua_setfield(L, -2, "response");
+	for (i = 0; i < MEMCACHED_PHASES; i++) {
+		lua_pushnumber(L, (lua_Number)e->value[i] / 1e9);
+		lua_setfield(L, -2, metricphases[i]);
+	}
+	lua_pushnumber(L, (lua_Number)e->time / 1000);
+	lua_setfield(L, -2, "time");
+}
 
-	/* create memcached */
-	m = lua_newuserdata(L, sizeof(memcached_t));
-	m->host_index = m->port_index = m->encode_index = m->decode_index = LUA_NOREF;
-	m->closed = 0;
-	m->fd = -1;
-	luaL_getmetatable(L, MEMCACHED_METATABLE);
-	lua_setmetatable(L, -2);
+static int hotindex (sketch_t *sk, uint64_t hash) {
+	int  i;
 
-	/* get configuration */
-	m->host_index = getstring(L, 1, "host", "localhost");
-	m->port_index = getstring(L, 1, "port", "11211");
-	m->encode_index = getfunction(L, 1, "encode", mencode);
-	m->decode_index = getfunction(L, 1, "decode", mdecode);
-	m->timeout = getint(L, 1, "timeout", 1000);
-	luaL_argcheck(L, m->timeout > 0, 1, "bad timeout");
-	m->reconnect = getboolean(L, 1, "reconnect", 1);
-	
-	return 1;
+	/* find the index slot of a hot key, or the free slot ending its probe */
+	i = (int)(hash >> 32) & (MEMCACHED_HOTKEYS_INDEX - 1);
+	while (sk->index[i] && sk->top[sk->index[i] - 1].hash != hash) {
+		i = (i + 1) & (MEMCACHED_HOTKEYS_INDEX - 1);
+	}
+	return i;
 }
 
-static int recvresponse (lua_State *L, memcached_t *m, uint16_t *status, uint64_t *cas, int flags) {
-	int                                 nret;
-	uint8_t                             extlen;
-	uint16_t                            keylen;
-	uint32_t                            bodylen, valuelen;
-	memcached_buffer_t                 *b;
-	protocol_binary_response_no_extras  response;
+static void hotremove (sketch_t *sk, int i) {
+	int  j, home;
 
-	/* receive */
-	recvnosig(L, m, &response, sizeof(response.bytes));
-	if (response.message.header.response.magic != PROTOCOL_BINARY_RES) {
-		close(m->fd);
-		m->fd = -1;
-		if (!m->reconnect) {
-			m->closed = 1;
+	/* remove an index slot, moving back later entries of its probe */
+	sk->index[i] = 0;
+	j = i;
+	for (;;) {
+		j = (j + 1) & (MEMCACHED_HOTKEYS_INDEX - 1);
+		if (!sk->index[j]) {
+			return;
+		}
+		home = (int)(sk->top[sk->index[j] - 1].hash >> 32) & (MEMCACHED_HOTKEYS_INDEX - 1);
+		if (((j - home) & (MEMCACHED_HOTKEYS_INDEX - 1))
+				>= ((j - i) & (MEMCACHED_HOTKEYS_INDEX - 1))) {
+			sk->index[i] = sk->index[j];
+			sk->index[j] = 0;
+			i = j;
 		}
-		return luaL_error(L, "bad response");
 	}
+}
 
-	/* status */
-	if (status) {
-		*status = be16toh(response.message.header.response.status);
+static void hotswap (sketch_t *sk, int i, int j) {
+	int       a, b;
+	hotkey_t  tmp;
+
+	/* swap two hot keys, keeping the index */
+	a = hotindex(sk, sk->top[i].hash);
+	b = hotindex(sk, sk->top[j].hash);
+	tmp = sk->top[i];
+	sk->top[i] = sk->top[j];
+	sk->top[j] = tmp;
+	sk->index[a] = (int16_t)(j + 1);
+	sk->index[b] = (int16_t)(i + 1);
+}
+
+static void siftdown (sketch_t *sk, int i) {
+	int  c;
+
+	/* restore the min-heap below an entry whose count has increased */
+	while ((c = 2 * i + 1) < sk->n) {
+		if (c + 1 < sk->n && sk->top[c + 1].count < sk->top[c].count) {
+			c++;
+		}
+		if (sk->top[i].count <= sk->top[c].count) {
+			break;
+		}
+		hotswap(sk, i, c);
+		i = c;
 	}
+}
 
-	/* CAS */
-	if (cas) {
-		*cas = be64toh(response.message.header.response.cas);
+static void siftup (sketch_t *sk, int i) {
+	int  p;
+
+	while (i > 0 && sk->top[p = (i - 1) / 2].count > sk->top[i].count) {
+		hotswap(sk, i, p);
+		i = p;
 	}
+}
 
-	/* extras */
-	nret = 0;
-	extlen = response.message.header.response.extlen;
-	if (extlen) {
-		recvstring(L, m, extlen);
-		if (flags & MEMCACHED_EXTRAS) {
-			nret++;
-		} else {
-			lua_pop(L, 1);
+static void track (memcached_t *m, mkey_t *k, int64_t size) {
+	int           i, j;
+	char          key[MEMCACHED_KEY_MAX];
+	size_t        keylen, prefixlen;
+	uint32_t     *c;
+	uint64_t      h1, h2, count;
+	const char   *colon;
+	sketch_t     *sk;
+	sizegroup_t  *g;
+
+	/* count the key in the sketch; rows use double hashing */
+	sk = m->sketch;
+	keylen = copykey(k, key, sizeof(key));
+	hashkey(key, keylen, &h1, &h2);
+	count = UINT64_MAX;
+	for (i = 0; i < MEMCACHED_SKETCH_DEPTH; i++) {
+		c = &sk->counts[i][(h1 + (uint64_t)i * h2) & (MEMCACHED_SKETCH_WIDTH - 1)];
+		if (*c < UINT32_MAX) {
+			(*c)++;
+		}
+		if (*c < count) {
+			count = *c;
 		}
 	}
 
-	/* key */
-	keylen = be16toh(response.message.header.response.keylen);
-	if (keylen) {
-		recvstring(L, m, keylen);
-		if (flags & MEMCACHED_KEY) {
-			nret++;
+	/* update the hot keys, replacing the least frequent key if the key is more frequent */
+	j = hotindex(sk, h1);
+	if (sk->index[j]) {
+		i = sk->index[j] - 1;
+		sk->top[i].count = count;
+		siftdown(sk, i);
+	} else if (sk->n < sk->k || count > sk->top[0].count) {
+		if (sk->n < sk->k) {
+			i = sk->n++;
 		} else {
-			lua_pop(L, 1);
+			i = 0;
+			hotremove(sk, hotindex(sk, sk->top[0].hash));
+			j = hotindex(sk, h1);
 		}
+		sk->index[j] = (int16_t)(i + 1);
+		sk->top[i].hash = h1;
+		sk->top[i].count = count;
+		sk->top[i].keylen = keylen;
+		memcpy(sk->top[i].key, key, keylen);
+		siftdown(sk, i);
+		siftup(sk, i);
 	}
 
-	/* value */
-	bodylen = be32toh(response.message.header.response.bodylen);
-	if (bodylen > extlen + keylen) {
-		valuelen = bodylen - (extlen + keylen);
-		if (flags & MEMCACHED_VALUE_BUFFER) {
-			b = lua_newuserdata(L, sizeof(memcached_buffer_t));
-			memset(b, 0, sizeof(memcached_buffer_t));
-			luaL_getmetatable(L, MEMCACHED_BUFFER_METATABLE);
-			lua_setmetatable(L, -2);
-			b->b = malloc(valuelen);
-			if (b->b == NULL) {
-				return luaL_error(L, "out of memory");
-			}
-			b->capacity = valuelen;
-			recvnosig(L, m, b->b, valuelen);
-			b->len = b->pos = valuelen;
-		} else {
-			recvstring(L, m, valuelen);
+	/* record the value size by key prefix, up to the first colon; excess prefixes share the
+	 * last group */
+	if (size < 0) {
+		return;
+	}
+	colon = memchr(k->key, ':', k->keylen);
+	prefixlen = colon ? (size_t)(colon - k->key) : k->keylen;
+	if (prefixlen > MEMCACHED_SIZE_PREFIX) {
+		prefixlen = MEMCACHED_SIZE_PREFIX;
+	}
+	for (i = 0; i < sk->ngroups; i++) {
+		g = &sk->groups[i];
+		if (g->prefixlen == prefixlen && memcmp(g->prefix, k->key, prefixlen) == 0) {
+			break;
 		}
-		if (flags & MEMCACHED_VALUE) {
-			nret++;
+	}
+	if (i == sk->ngroups) {
+		if (sk->ngroups < MEMCACHED_SIZE_GROUPS - 1) {
+			g = &sk->groups[sk->ngroups++];
+			g->prefixlen = prefixlen;
+			memcpy(g->prefix, k->key, prefixlen);
 		} else {
-			lua_pop(L, 1);
+			g = &sk->groups[MEMCACHED_SIZE_GROUPS - 1];
+			g->prefixlen = 1;
+			g->prefix[0] = '*';
+			sk->ngroups = MEMCACHED_SIZE_GROUPS;
 		}
 	} else {
-		if (flags & MEMCACHED_VALUE) {
-			if (flags & MEMCACHED_VALUE_BUFFER) {
-				b = lua_newuserdata(L, sizeof(memcached_buffer_t));
-				memset(b, 0, sizeof(memcached_buffer_t));
-				luaL_getmetatable(L, MEMCACHED_BUFFER_METATABLE);
-				lua_setmetatable(L, -2);
-			} else {
-				lua_pushliteral(L, "");
-			}
-			nret++;
-		}
+		g = &sk->groups[i];
+	}
+	g->count++;
+	g->bytes += (uint64_t)size;
+	if ((uint64_t)size > g->max) {
+		g->max = (uint64_t)size;
 	}
-
-	return nret;
 }
 
-static int backoff (lua_State *L, int min, int max, int* result) {
-	uintptr_t  p;
+static int comparehotkeys (const void *a, const void *b) {
+	const hotkey_t  *ha = a, *hb = b;
 
-	/* source: https://github.com/skeeto/hash-prospector */
-	p = (uintptr_t)L;
-	p ^= p >> 16;
-	p *= 0x7feb352d;
-	p ^= p >> 15;
-	p *= 0x846ca68b;
-	p ^= p >> 16;
-	*result = (int)(min + (p % (max - min + 1)));
-	return 0;
+	return ha->count < hb->count ? 1 : (ha->count > hb->count ? -1 : 0);
 }
 
-static int get (lua_State *L) {
-	int                          nret;
-	size_t                       keylen;
-	uint16_t                     status;
-	uint64_t                     cas;
-	const char                  *key;
-	memcached_t                 *m;
-	struct iovec                 iov[2];
-	protocol_binary_request_get  request;
+static int hotkeys (lua_State *L) {
+	int           i, n;
+	hotkey_t     *top;
+	memcached_t  *m;
 
 	/* check arguments */
 	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	key = luaL_checklstring(L, 2, &keylen);
-	luaL_argcheck(L, keylen > 0 && keylen <= UINT16_MAX, 2, "bad key length");
-
-	/* prepare request */
-	memset(&request, 0, sizeof(request));
-	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET;
-	request.message.header.request.extlen = MEMCACHED_REQUEST_GET_EXTRAS;
-	request.message.header.request.keylen = htobe16((uint16_t)keylen);
-	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_GET_EXTRAS
-			+ keylen));
-
-	/* send request */
-	getsocket(L, m);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *)key;
-	iov[1].iov_len = (uint16_t)keylen;
-	sendmsgnosig(L, m, iov, 2);
+	n = (int)luaL_optinteger(L, 2, MEMCACHED_HOTKEYS_MAX);
+	luaL_argcheck(L, n >= 0, 2, "bad count");
 
-	/* push decode function */
-	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
+	/* return the hot keys, most frequent first */
+	if (!m->sketch) {
+		lua_newtable(L);
+		return 1;
+	}
+	top = lua_newuserdata(L, m->sketch->n * sizeof(hotkey_t) + 1);
+	memcpy(top, m->sketch->top, m->sketch->n * sizeof(hotkey_t));
+	qsort(top, (size_t)m->sketch->n, sizeof(hotkey_t), comparehotkeys);
+	if (n > m->sketch->n) {
+		n = m->sketch->n;
+	}
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_createtable(L, 0, 2);
+		lua_pushlstring(L, top[i].key, top[i].keylen);
+		lua_setfield(L, -2, "key");
+		lua_pushinteger(L, (lua_Integer)top[i].count);
+		lua_setfield(L, -2, "count");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
 
-	/* read response */
-	nret = recvresponse(L, m, &status, &cas, MEMCACHED_VALUE | MEMCACHED_VALUE_BUFFER);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		if (nret != 1) {
-			return luaL_error(L, "protocol error");
-		}
-		lua_call(L, 1, 1);
-		lua_pushinteger(L, cas);
-		return 2;
+static int sizereport (lua_State *L) {
+	int           i;
+	sizegroup_t  *g;
+	memcached_t  *m;
 
-	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
-		lua_pushnil(L);
-		return 1;
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
 
-	default:
-		return luaL_error(L, "memcached error (%d)", (int)status);
+	/* return value sizes, by key prefix */
+	lua_newtable(L);
+	for (i = 0; m->sketch && i < m->sketch->ngroups; i++) {
+		g = &m->sketch->groups[i];
+		lua_pushlstring(L, g->prefix, g->prefixlen);
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, (lua_Integer)g->count);
+		lua_setfield(L, -2, "count");
+		lua_pushinteger(L, (lua_Integer)g->bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_pushnumber(L, g->count ? (lua_Number)g->bytes / g->count : 0);
+		lua_setfield(L, -2, "mean");
+		lua_pushinteger(L, (lua_Integer)g->max);
+		lua_setfield(L, -2, "max");
+		lua_rawset(L, -3);
 	}
+	return 1;
 }
 
-static int set (lua_State *L) {
-	size_t                          keylen, valuelen;
-	uint16_t                        status;
-	uint64_t                        cas;
-	const char                     *key, *value;
-	lua_Integer                     expiration;
-	memcached_t                    *m;
-	struct iovec                    iov[3];
-	memcached_buffer_t             *b;
-	protocol_binary_request_set     srequest;
-	protocol_binary_request_delete  drequest;
+static int slowlog (lua_State *L) {
+	int           i;
+	memcached_t  *m;
 
 	/* check arguments */
 	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	key = luaL_checklstring(L, 2, &keylen);
-	luaL_argcheck(L, keylen > 0 && keylen <= UINT16_MAX, 2, "bad key length");
-	if (lua_tointeger(L, lua_upvalueindex(1)) == PROTOCOL_BINARY_CMD_SET) {
-		luaL_checkany(L, 3);
-	} else {
-		luaL_argcheck(L, !lua_isnoneornil(L, 3), 3, "value required");
+
+	/* return slow operations, oldest first; none without a ring */
+	if (m->slowlog == NULL) {
+		lua_newtable(L);
+		return 1;
 	}
-	expiration = luaL_optinteger(L, 4, 0);
-	luaL_argcheck(L, expiration >= 0 && expiration <= UINT32_MAX, 4, "bad expiration");
-	cas = luaL_optinteger(L, 5, 0);
+	lua_createtable(L, m->slowlogcount, 0);
+	for (i = 0; i < m->slowlogcount; i++) {
+		pushslowop(L, &m->slowlog[(m->slowloghead - m->slowlogcount + i + m->slowlogsize)
+				% m->slowlogsize]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	if (lua_toboolean(L, 2)) {
+		m->slowloghead = m->slowlogcount = 0;
+	}
+	return 1;
+}
 
-	/* handle both set and delete */
-	if (!lua_isnil(L, 3)) {
-		/* encode */
-		lua_rawgeti(L, LUA_REGISTRYINDEX, m->encode_index);
-		lua_pushvalue(L, 3);
-		lua_call(L, 1, 1);
+static void pushhistogram (lua_State *L, histogram_t *h) {
+	int        i, j;
+	uint64_t   cnt, rank, limit;
+	static const struct {
+		const char  *name;
+		double       q;
+	} quantiles[] = {
+		{ "p50", 0.5 },
+		{ "p90", 0.9 },
+		{ "p99", 0.99 },
+		{ "p999", 0.999 }
+	};
+
+	/* seconds; quantiles are bucket limits, bounded by the maximum */
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, h->count ? (lua_Number)h->sum / h->count / 1e9 : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, (lua_Number)h->max / 1e9);
+	lua_setfield(L, -2, "max");
+	i = 0;
+	cnt = 0;
+	for (j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+		rank = (uint64_t)ceil(quantiles[j].q * h->count);
+		while (i < MEMCACHED_HISTOGRAM_BUCKETS - 1 && cnt + h->buckets[i] < rank) {
+			cnt += h->buckets[i++];
+		}
+		limit = bucketlimit(i);
+		lua_pushnumber(L, (lua_Number)(limit < h->max ? limit : h->max) / 1e9);
+		lua_setfield(L, -2, quantiles[j].name);
+	}
+}
+
+static inline void tally (memcached_t *m, int index, uint64_t n) {
+	m->tally[index] += n;
+	m->totals[index] += n;
+}
+
+static void pushtallies (lua_State *L, const uint64_t *tally) {
+	int  i;
+	static const char *const names[MEMCACHED_TALLY_STATUS] = {
+		"bytes_sent", "bytes_received", "sends", "receives", "connects", "reconnects", "hits",
+		"misses"
+	};
+
+	/* set the counters in the table on top of the stack */
+	for (i = 0; i < MEMCACHED_TALLY_STATUS; i++) {
+		lua_pushinteger(L, (lua_Integer)tally[i]);
+		lua_setfield(L, -2, names[i]);
+	}
+	lua_newtable(L);
+	for (i = 0; i < MEMCACHED_TALLIES - MEMCACHED_TALLY_STATUS; i++) {
+		if (tally[MEMCACHED_TALLY_STATUS + i] > 0) {
+			lua_pushinteger(L, (lua_Integer)tally[MEMCACHED_TALLY_STATUS + i]);
+			lua_rawseti(L, -2, i);
+		}
+	}
+	lua_setfield(L, -2, "errors");
+}
+
+static int metrics (lua_State *L) {
+	int           op, phase;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+
+	/* counters */
+	lua_newtable(L);
+	pushtallies(L, m->tally);
+
+	/* latency histograms, by operation and phase */
+	if (m->metrics) {
+		lua_newtable(L);
+		for (op = 0; op < MEMCACHED_METRIC_OPS; op++) {
+			if (m->metrics->latency[op][MEMCACHED_PHASE_TOTAL].count == 0) {
+				continue;
+			}
+			lua_createtable(L, 0, 1 + MEMCACHED_PHASES);
+			lua_pushinteger(L, (lua_Integer)m->metrics->latency[op][MEMCACHED_PHASE_TOTAL]
+					.count);
+			lua_setfield(L, -2, "count");
+			for (phase = 0; phase < MEMCACHED_PHASES; phase++) {
+				pushhistogram(L, &m->metrics->latency[op][phase]);
+				lua_setfield(L, -2, metricphases[phase]);
+			}
+			lua_setfield(L, -2, metricops[op]);
+		}
+		lua_setfield(L, -2, "latency");
+		if (lua_toboolean(L, 2)) {
+			memset(m->metrics->latency, 0, sizeof(m->metrics->latency));
+		}
+	}
+	return 1;
+}
+
+static int mmetrics (lua_State *L) {
+	/* counters of all instances */
+	lua_newtable(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, MEMCACHED_TOTALS);
+	pushtallies(L, lua_touserdata(L, -1));
+	lua_pop(L, 1);
+	return 1;
+}
+
+static void addline (lua_State *L, const char *fmt, ...) {
+	va_list  ap;
+
+	/* append a line to the lines table at index 2 */
+	va_start(ap, fmt);
+	lua_pushvfstring(L, fmt, ap);
+	va_end(ap);
+	lua_rawseti(L, 2, (lua_Integer)lua_rawlen(L, 2) + 1);
+}
+
+static int prometheus (lua_State *L) {
+	int           i, j, k;
+	size_t        n, l;
+	luaL_Buffer   B;
+	static const char *const counters[][2] = {
+		{ "bytes_sent", "memcached_client_sent_bytes_total" },
+		{ "bytes_received", "memcached_client_received_bytes_total" },
+		{ "sends", "memcached_client_send_calls_total" },
+		{ "receives", "memcached_client_receive_calls_total" },
+		{ "connects", "memcached_client_connects_total" },
+		{ "reconnects", "memcached_client_reconnects_total" },
+		{ "hits", "memcached_client_hits_total" },
+		{ "misses", "memcached_client_misses_total" }
+	};
+	static const char *const quantiles[][2] = {
+		{ "p50", "0.5" },
+		{ "p90", "0.9" },
+		{ "p99", "0.99" },
+		{ "p999", "0.999" }
+	};
+
+	/* check arguments; the metrics default to the module totals */
+	if (lua_isnoneornil(L, 1)) {
+		lua_settop(L, 0);
+		mmetrics(L);
+	} else {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_settop(L, 1);
+	}
+	lua_newtable(L);
+
+	/* counters */
+	for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++) {
+		lua_getfield(L, 1, counters[i][0]);
+		if (lua_isinteger(L, -1)) {
+			addline(L, "# TYPE %s counter\n%s %I\n", counters[i][1], counters[i][1],
+					lua_tointeger(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+
+	/* errors, by status */
+	lua_getfield(L, 1, "errors");
+	if (lua_istable(L, -1)) {
+		addline(L, "# TYPE memcached_client_errors_total counter\n");
+		for (i = 0; i < MEMCACHED_TALLIES - MEMCACHED_TALLY_STATUS; i++) {
+			lua_rawgeti(L, -1, i);
+			if (lua_isinteger(L, -1)) {
+				addline(L, "memcached_client_errors_total{status=\"%d\"} %I\n", i,
+						lua_tointeger(L, -1));
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	/* latency summaries, by operation and phase */
+	lua_getfield(L, 1, "latency");
+	if (lua_istable(L, -1)) {
+		addline(L, "# TYPE memcached_client_latency_seconds summary\n");
+		for (i = 0; i < MEMCACHED_METRIC_OPS; i++) {
+			lua_getfield(L, -1, metricops[i]);
+			for (j = 0; lua_istable(L, -1) && j < MEMCACHED_PHASES; j++) {
+				lua_getfield(L, -1, metricphases[j]);
+				if (lua_istable(L, -1)) {
+					for (k = 0; k < (int)(sizeof(quantiles) / sizeof(quantiles[0])); k++) {
+						lua_getfield(L, -1, quantiles[k][0]);
+						addline(L, "memcached_client_latency_seconds{op=\"%s\",phase=\"%s\","
+								"quantile=\"%s\"} %f\n", metricops[i], metricphases[j],
+								quantiles[k][1], lua_tonumber(L, -1));
+						lua_pop(L, 1);
+					}
+					lua_getfield(L, -2, "count");
+					lua_getfield(L, -2, "mean");
+					addline(L, "memcached_client_latency_seconds_sum{op=\"%s\",phase=\"%s\"} %f\n"
+							"memcached_client_latency_seconds_count{op=\"%s\",phase=\"%s\"} %I\n",
+							metricops[i], metricphases[j], lua_tonumber(L, -1)
+							* lua_tonumber(L, -2), metricops[i], metricphases[j],
+							lua_tointeger(L, -2));
+					lua_pop(L, 2);
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	/* concatenate lines */
+	luaL_buffinit(L, &B);
+	n = lua_rawlen(L, 2);
+	for (l = 1; l <= n; l++) {
+		lua_rawgeti(L, 2, (lua_Integer)l);
+		luaL_addvalue(&B);
+	}
+	luaL_pushresult(&B);
+	return 1;
+}
+
+
+/*
+ * main
+*/
+
+static int getstring (lua_State *L, int index, const char *field, const char *dflt) {
+	if (lua_isnoneornil(L, index)) {
+		lua_pushstring(L, dflt);
+	} else {
+		switch (lua_getfield(L, index, field)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			lua_pushstring(L, dflt);
+			break;
+
+		case LUA_TSTRING:
+			break;
+
+		case LUA_TNUMBER:
+			lua_tostring(L, -1);
+			break;
+
+		default:
+			return luaL_error(L, "bad field '%s' (string expected, got %s)", field,
+						luaL_typename(L, -1));
+		}
+	}
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int getfunction (lua_State *L, int index, const char *field, lua_CFunction dflt) {
+	/* without a default, a missing field yields no reference */
+	if (lua_isnoneornil(L, index)) {
+		if (!dflt) {
+			return LUA_NOREF;
+		}
+		lua_pushcfunction(L, dflt);
+	} else {
+		switch (lua_getfield(L, index, field)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			if (!dflt) {
+				return LUA_NOREF;
+			}
+			lua_pushcfunction(L, dflt);
+			break;
+
+		case LUA_TFUNCTION:
+			break;
+
+		default:
+			return luaL_error(L, "bad field '%s' (function expected, got %s)", field, 
+					luaL_typename(L, -1));
+		}
+	}
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int getint (lua_State *L, int index, const char *field, int dflt) {
+	int          isinteger;
+	lua_Integer  result;
+
+	if (lua_isnoneornil(L, index)) {
+		return dflt;
+	} else {
+		switch (lua_getfield(L, index, field)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			return dflt;
+
+		case LUA_TNUMBER:
+			result = lua_tointegerx(L, -1, &isinteger);
+			if (isinteger && result >= INT_MIN && result <= INT_MAX) {
+				lua_pop(L, 1);
+				return result;
+			}
+			/* fall through */
+
+		default:
+			return luaL_error(L, "bad field '%s' (int expected, got %s)", field,
+					luaL_typename(L, -1));
+		}
+	}
+}
+
+static int getboolean (lua_State *L, int index, const char *field, int dflt) {
+	int  result;
+
+	if (lua_isnoneornil(L, index)) {
+		return dflt;
+	} else {
+		switch (lua_getfield(L, index, field)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			return dflt;
+
+		case LUA_TBOOLEAN:
+			result = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			return result;
+
+		default:
+			return luaL_error(L, "bad field '%s' (boolean expected, got %s)", field,
+					luaL_typename(L, -1));
+		}
+	}
+}
+
+static lua_Number getnumber (lua_State *L, int index, const char *field, lua_Number dflt) {
+	lua_Number  result;
+
+	if (lua_isnoneornil(L, index)) {
+		return dflt;
+	} else {
+		switch (lua_getfield(L, index, field)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			return dflt;
+
+		case LUA_TNUMBER:
+			result = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+			return result;
+
+		default:
+			return luaL_error(L, "bad field '%s' (number expected, got %s)", field,
+					luaL_typename(L, -1));
+		}
+	}
+}
+
+static uint64_t clockms (clockid_t clock) {
+	struct timespec  ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double random01 (memcached_t *m) {
+	uint64_t  x;
+
+	/* source: https://prng.di.unimi.it/splitmix64.c */
+	x = (m->random += 0x9e3779b97f4a7c15);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	x ^= x >> 31;
+	return ((x >> 11) + 1) * 0x1.0p-53;  /* (0, 1] */
+}
+
+static int mopen (lua_State *L) {
+	int           hot;
+	lua_Number    slow;
+	memcached_t  *m;
+
+	/* check arguments */
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+	}
+
+	/* create memcached */
+	m = lua_newuserdata(L, sizeof(memcached_t));
+	m->host_index = m->port_index = m->encode_index = m->decode_index = m->prefix_index
+			= m->counters_index = m->ratelimits_index = m->deltas_index = m->dedup_index
+			= m->pending_index = m->errors_index = m->prefetch_index = m->slowhandler_index
+			= LUA_NOREF;
+	m->dedupcount = m->ratelimitcount = 0;
+	m->deltasize = 0;
+	m->queue = NULL;
+	m->queuelen = m->queuecap = 0;
+	m->seq = m->sent = m->acked = 0;
+	m->metrics = NULL;
+	m->sketch = NULL;
+	m->codec = 0;
+	m->slowlog = NULL;
+	m->slowloghead = m->slowlogcount = 0;
+	memset(m->tally, 0, sizeof(m->tally));
+	lua_getfield(L, LUA_REGISTRYINDEX, MEMCACHED_TOTALS);
+	m->totals = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	m->prefix = NULL;
+	m->prefixlen = 0;
+	m->closed = 0;
+	m->timed = 0;
+	m->fd = -1;
+	m->input = NULL;
+	m->inputpos = m->inputlen = m->inputcap = 0;
+	luaL_getmetatable(L, MEMCACHED_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* get configuration */
+	m->host_index = getstring(L, 1, "host", "localhost");
+	m->port_index = getstring(L, 1, "port", "11211");
+	m->encode_index = getfunction(L, 1, "encode", mencode);
+	m->decode_index = getfunction(L, 1, "decode", mdecode);
+	m->timeout = getint(L, 1, "timeout", 1000);
+	luaL_argcheck(L, m->timeout > 0, 1, "bad timeout");
+	m->reconnect = getboolean(L, 1, "reconnect", 1);
+	m->prefix_index = getstring(L, 1, "prefix", "");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->prefix_index);
+	m->prefix = lua_tolstring(L, -1, &m->prefixlen);
+	lua_pop(L, 1);
+	luaL_argcheck(L, m->prefixlen <= MEMCACHED_PREFIX_MAX, 1, "bad prefix");
+	m->keylimit = getint(L, 1, "keylimit", 0);
+	luaL_argcheck(L, m->keylimit == 0 || (m->keylimit > MEMCACHED_KEY_HASH
+			&& m->keylimit <= MEMCACHED_KEY_MAX), 1, "bad keylimit");
+	m->keycheck = getboolean(L, 1, "keycheck", 0);
+	luaL_argcheck(L, !m->keycheck || validkey(m->prefix, m->prefixlen), 1, "bad prefix");
+	m->xfetch = getnumber(L, 1, "xfetch", 0);
+	luaL_argcheck(L, m->xfetch >= 0, 1, "bad xfetch");
+	m->jitter = getnumber(L, 1, "jitter", 0);
+	luaL_argcheck(L, m->jitter >= 0 && m->jitter < 1, 1, "bad jitter");
+	m->deltas = getint(L, 1, "deltas", 0);
+	luaL_argcheck(L, m->deltas >= 0, 1, "bad deltas");
+	m->dedup = getint(L, 1, "dedup", 0);
+	luaL_argcheck(L, m->dedup >= 0, 1, "bad dedup");
+	m->canonical = getboolean(L, 1, "canonical", 0);
+	m->queuelimit = getint(L, 1, "queue", 65536);
+	luaL_argcheck(L, m->queuelimit > 0, 1, "bad queue");
+	slow = getnumber(L, 1, "slow", 0);
+	luaL_argcheck(L, slow >= 0 && slow <= MEMCACHED_TTL_MAX, 1, "bad slow");
+	m->slow = (uint64_t)(slow * 1e9);
+	m->slowlogsize = getint(L, 1, "slowlog", 64);
+	luaL_argcheck(L, m->slowlogsize > 0, 1, "bad slowlog");
+	m->slowhandler_index = getfunction(L, 1, "slowhandler", NULL);
+	if (getboolean(L, 1, "metrics", 0)) {
+		m->metrics = calloc(1, sizeof(metrics_t));
+		if (m->metrics == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+	}
+	hot = getint(L, 1, "hotkeys", 0);
+	luaL_argcheck(L, hot >= 0 && hot <= MEMCACHED_HOTKEYS_MAX, 1, "bad hotkeys");
+	if (hot > 0) {
+		m->sketch = calloc(1, sizeof(sketch_t) + (size_t)hot * sizeof(hotkey_t));
+		if (m->sketch == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		m->sketch->k = hot;
+	}
+	if (m->slow > 0 && m->slowhandler_index == LUA_NOREF) {
+		m->slowlog = calloc((size_t)m->slowlogsize, sizeof(slowop_t));
+		if (m->slowlog == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+	}
+	m->timed = m->metrics != NULL || m->slow > 0;
+	m->random = (uint64_t)(uintptr_t)m ^ clockms(CLOCK_REALTIME);
+
+	return 1;
+}
+
+static memcached_t *checkmemcached (lua_State *L, int index, mkey_t *k) {
+	memcached_t  *m;
+	namespace_t  *ns;
+
+	k->ns = NULL;
+	k->nslen = 0;
+	ns = luaL_testudata(L, index, MEMCACHED_NAMESPACE_METATABLE);
+	if (!ns) {
+		m = luaL_checkudata(L, index, MEMCACHED_METATABLE);
+		k->prefix = m->prefix;
+		k->prefixlen = m->prefixlen;
+		return m;
+	}
+
+	/* namespace; the instance is kept alive by the namespace reference */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ns->memcached_index);
+	m = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	k->prefix = m->prefix;
+	k->prefixlen = m->prefixlen;
+	generation(L, m, ns, 0);
+	k->ns = ns->prefix;
+	k->nslen = ns->prefixlen;
+	return m;
+}
+
+static int checkkey (lua_State *L, memcached_t *m, int index, mkey_t *k) {
+	size_t    keep;
+	uint64_t  h1, h2;
+
+	k->key = luaL_checklstring(L, index, &k->keylen);
+	luaL_argcheck(L, k->keylen > 0 && k->keylen <= UINT16_MAX - k->prefixlen - k->nslen, index,
+			"bad key length");
+	if (m->keycheck) {
+		luaL_argcheck(L, validkey(k->key, k->keylen), index, "bad key");
+	}
+	k->len = k->prefixlen + k->nslen + k->keylen;
+
+	/* replace the tail of long keys with a hash of the key */
+	if (m->keylimit && k->len > (size_t)m->keylimit) {
+		luaL_argcheck(L, k->prefixlen + k->nslen + MEMCACHED_KEY_HASH <= (size_t)m->keylimit,
+				index, "bad key length");
+		keep = m->keylimit - (k->prefixlen + k->nslen + MEMCACHED_KEY_HASH);
+		hashkey(k->key, k->keylen, &h1, &h2);
+		memcpy(k->buf, k->key, keep);
+		snprintf(&k->buf[keep], MEMCACHED_KEY_HASH + 1, "%016" PRIx64 "%016" PRIx64, h1, h2);
+		k->key = k->buf;
+		k->keylen = keep + MEMCACHED_KEY_HASH;
+		k->len = m->keylimit;
+	}
+	return 0;
+}
+
+static int validkey (const char *key, size_t len) {
+	size_t          i;
+	uint64_t        x, y;
+	const uint64_t  ones = ~(uint64_t)0 / 255, highs = ones * 0x80;
+
+	/* check 8 bytes at a time for bytes below 0x21 (space and control) and 0x7f (delete) */
+	for (i = 0; i + sizeof(x) <= len; i += sizeof(x)) {
+		memcpy(&x, &key[i], sizeof(x));
+		y = x ^ (ones * 0x7f);
+		if (((x - ones * 0x21) & ~x & highs) || ((y - ones) & ~y & highs)) {
+			return 0;
+		}
+	}
+	for (; i < len; i++) {
+		if ((unsigned char)key[i] <= 0x20 || key[i] == 0x7f) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline uint64_t rotl64 (uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64 (uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccd;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53;
+	k ^= k >> 33;
+	return k;
+}
+
+static void hashkey (const char *key, size_t len, uint64_t *h1, uint64_t *h2) {
+	size_t          i, j;
+	uint64_t        k1, k2;
+	const uint64_t  c1 = 0x87c37b91114253d5, c2 = 0x4cf5ad432745937f;
+
+	/* source: https://github.com/aappleby/smhasher (MurmurHash3_x64_128, seed 0) */
+	*h1 = *h2 = 0;
+	for (i = 0; i + 16 <= len; i += 16) {
+		memcpy(&k1, &key[i], sizeof(k1));
+		memcpy(&k2, &key[i + 8], sizeof(k2));
+		k1 = rotl64(le64toh(k1) * c1, 31) * c2;
+		*h1 ^= k1;
+		*h1 = (rotl64(*h1, 27) + *h2) * 5 + 0x52dce729;
+		k2 = rotl64(le64toh(k2) * c2, 33) * c1;
+		*h2 ^= k2;
+		*h2 = (rotl64(*h2, 31) + *h1) * 5 + 0x38495ab5;
+	}
+
+	/* tail */
+	k1 = k2 = 0;
+	for (j = len - i; j > 8; j--) {
+		k2 ^= (uint64_t)(unsigned char)key[i + j - 1] << ((j - 9) * 8);
+	}
+	for (; j > 0; j--) {
+		k1 ^= (uint64_t)(unsigned char)key[i + j - 1] << ((j - 1) * 8);
+	}
+	if (len - i > 8) {
+		*h2 ^= rotl64(k2 * c2, 33) * c1;
+	}
+	if (len - i > 0) {
+		*h1 ^= rotl64(k1 * c1, 31) * c2;
+	}
+
+	/* finalize */
+	*h1 ^= len;
+	*h2 ^= len;
+	*h1 += *h2;
+	*h2 += *h1;
+	*h1 = fmix64(*h1);
+	*h2 = fmix64(*h2);
+	*h1 += *h2;
+	*h2 += *h1;
+}
+
+static int keyiov (mkey_t *k, struct iovec *iov) {
+	int  n;
+
+	n = 0;
+	if (k->prefixlen) {
+		iov[n].iov_base = (void *)k->prefix;
+		iov[n++].iov_len = k->prefixlen;
+	}
+	if (k->nslen) {
+		iov[n].iov_base = (void *)k->ns;
+		iov[n++].iov_len = k->nslen;
+	}
+	iov[n].iov_base = (void *)k->key;
+	iov[n++].iov_len = k->keylen;
+	return n;
+}
+
+static lua_Integer checkexpiration (lua_State *L, memcached_t *m, int index, lua_Integer *ttl) {
+	lua_Integer  expiration, now;
+
+	/* check argument */
+	expiration = luaL_optinteger(L, index, 0);
+	luaL_argcheck(L, expiration >= 0 && expiration <= UINT32_MAX, index, "bad expiration");
+	if (expiration == 0) {
+		*ttl = 0;
+		return 0;
+	}
+
+	/* beyond 30 days, memcached expects an absolute time; times in the past expire at once */
+	now = (lua_Integer)(clockms(CLOCK_REALTIME) / 1000);
+	if (expiration > MEMCACHED_TTL_MAX) {
+		if (expiration <= now) {
+			*ttl = 0;
+			return expiration;
+		}
+		*ttl = expiration - now;
+	} else {
+		*ttl = expiration;
+	}
+
+	/* apply jitter */
+	if (m->jitter > 0) {
+		*ttl += llround(*ttl * m->jitter * (2 * random01(m) - 1));
+	}
+	if (*ttl < 1) {
+		*ttl = 1;
+	}
+
+	/* convert to protocol representation */
+	if (*ttl <= MEMCACHED_TTL_MAX) {
+		return *ttl;
+	}
+	if (now + *ttl > UINT32_MAX) {
+		*ttl = UINT32_MAX - now;
+	}
+	return now + *ttl;
+}
+
+static int recvresponse (lua_State *L, memcached_t *m, uint16_t *status, uint64_t *cas,
+		uint32_t *opaque, int flags) {
+	int                                 nret;
+	uint8_t                             extlen;
+	uint16_t                            keylen;
+	uint32_t                            bodylen, valuelen;
+	memcached_buffer_t                 *b;
+	protocol_binary_response_no_extras  response;
+
+	/* receive, recording failed queued writes */
+	while (1) {
+		recvnosig(L, m, &response, sizeof(response.bytes));
+		if (response.message.header.response.magic != PROTOCOL_BINARY_RES) {
+			disconnect(L, m);
+			if (!m->reconnect) {
+				m->closed = 1;
+			}
+			return luaL_error(L, "bad response");
+		}
+		if (!(response.message.header.response.opaque & MEMCACHED_OPAQUE_ASYNC)
+				|| response.message.header.response.opaque == MEMCACHED_OPAQUE_NOOP) {
+			break;
+		}
+		bodylen = be32toh(response.message.header.response.bodylen);
+		if (bodylen > 0) {
+			recvstring(L, m, bodylen);
+			lua_pop(L, 1);
+		}
+		queuederror(L, m, response.message.header.response.opaque,
+				be16toh(response.message.header.response.status));
+	}
+	if (m->acked != m->sent) {
+		ackqueued(L, m);
+	}
+
+	/* status; expected failures, such as missing keys and CAS conflicts, are not errors */
+	switch (be16toh(response.message.header.response.status)) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+	case PROTOCOL_BINARY_RESPONSE_NOT_STORED:
+	case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL:
+		break;
+
+	default:
+		tally(m, MEMCACHED_TALLY_STATUS + (be16toh(response.message.header.response.status)
+				< 255 ? be16toh(response.message.header.response.status) : 255), 1);
+	}
+	if (status) {
+		*status = be16toh(response.message.header.response.status);
+	}
+
+	/* CAS */
+	if (cas) {
+		*cas = be64toh(response.message.header.response.cas);
+	}
+
+	/* opaque */
+	if (opaque) {
+		*opaque = response.message.header.response.opaque;
+	}
+
+	/* extras */
+	nret = 0;
+	extlen = response.message.header.response.extlen;
+	if (extlen) {
+		recvstring(L, m, extlen);
+		if (flags & MEMCACHED_EXTRAS) {
+			nret++;
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+
+	/* key */
+	keylen = be16toh(response.message.header.response.keylen);
+	if (keylen) {
+		recvstring(L, m, keylen);
+		if (flags & MEMCACHED_KEY) {
+			nret++;
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+
+	/* value */
+	bodylen = be32toh(response.message.header.response.bodylen);
+	if (bodylen > extlen + keylen) {
+		valuelen = bodylen - (extlen + keylen);
+		if (flags & MEMCACHED_VALUE_BUFFER) {
+			b = lua_newuserdata(L, sizeof(memcached_buffer_t));
+			memset(b, 0, sizeof(memcached_buffer_t));
+			luaL_getmetatable(L, MEMCACHED_BUFFER_METATABLE);
+			lua_setmetatable(L, -2);
+			b->b = malloc(valuelen);
+			if (b->b == NULL) {
+				return luaL_error(L, "out of memory");
+			}
+			b->capacity = valuelen;
+			recvnosig(L, m, b->b, valuelen);
+			b->len = b->pos = valuelen;
+		} else {
+			recvstring(L, m, valuelen);
+		}
+		if (flags & MEMCACHED_VALUE) {
+			nret++;
+		} else {
+			lua_pop(L, 1);
+		}
+	} else {
+		if (flags & MEMCACHED_VALUE) {
+			if (flags & MEMCACHED_VALUE_BUFFER) {
+				b = lua_newuserdata(L, sizeof(memcached_buffer_t));
+				memset(b, 0, sizeof(memcached_buffer_t));
+				luaL_getmetatable(L, MEMCACHED_BUFFER_METATABLE);
+				lua_setmetatable(L, -2);
+			} else {
+				lua_pushliteral(L, "");
+			}
+			nret++;
+		}
+	}
+
+	return nret;
+}
+
+static int backoff (lua_State *L, int min, int max, int* result) {
+	uintptr_t  p;
+
+	/* source: https://github.com/skeeto/hash-prospector */
+	p = (uintptr_t)L;
+	p ^= p >> 16;
+	p *= 0x7feb352d;
+	p ^= p >> 15;
+	p *= 0x846ca68b;
+	p ^= p >> 16;
+	*result = (int)(min + (p % (max - min + 1)));
+	return 0;
+}
+
+static int retrywait (lua_State *L, int *backoff_ms) {
+	struct timespec  ts;
+
+	if (*backoff_ms == 0) {
+		backoff(L, 5, 25, backoff_ms);
+	} else {
+		*backoff_ms *= 2;
+	}
+	ts.tv_sec = *backoff_ms / 1000;
+	ts.tv_nsec = (*backoff_ms % 1000) * 1000000;
+	(void)nanosleep(&ts, NULL);
+	return 0;
+}
+
+static int encodevalue (lua_State *L, memcached_t *m, int index, int record, const char **value,
+		size_t *valuelen) {
+	uint64_t             start;
+	memcached_buffer_t  *b;
+
+	start = m->timed ? clockns() : 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->encode_index);
+	lua_pushvalue(L, index);
+	if (m->canonical) {
+		lua_pushboolean(L, record);
+		lua_pushboolean(L, 1);
+		lua_call(L, 3, 1);
+	} else if (record) {
+		lua_pushboolean(L, 1);
+		lua_call(L, 2, 1);
+	} else {
+		lua_call(L, 1, 1);
+	}
+	if (m->timed) {
+		m->codec += clockns() - start;
+	}
+	b = luaL_testudata(L, -1, MEMCACHED_BUFFER_METATABLE);
+	if (b) {
+		*value = b->b;
+		*valuelen = b->pos;
+	} else {
+		*value = lua_tolstring(L, -1, valuelen);
+		if (!*value) {
+			return luaL_error(L, "encoder must return buffer or string");
+		}
+	}
+	return 1;
+}
+
+static int fetch (lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration, uint64_t *cas,
+		int *refresh) {
+	int                  nret, iovcnt;
+	size_t               len;
+	uint16_t             status;
+	uint32_t             itemflags;
+	uint64_t             start;
+	const char          *s;
+	struct iovec         iov[1 + MEMCACHED_KEY_IOVCNT];
+	memcached_buffer_t  *b;
+	request_t            request;
+	optimer_t            t;
+
+	/* prepare request; a non-negative expiration gets and touches */
+	opstart(m, &t);
+	memset(&request, 0, sizeof(request));
+	request.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.header.request.keylen = htobe16((uint16_t)k->len);
+	if (expiration < 0) {
+		request.header.request.opcode = PROTOCOL_BINARY_CMD_GET;
+		request.header.request.extlen = MEMCACHED_REQUEST_GET_EXTRAS;
+		request.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_GET_EXTRAS
+				+ k->len));
+		iov[0].iov_len = sizeof(request.get.bytes);
+	} else {
+		request.header.request.opcode = PROTOCOL_BINARY_CMD_GAT;
+		request.header.request.extlen = MEMCACHED_REQUEST_TOUCH_EXTRAS;
+		request.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_TOUCH_EXTRAS
+				+ k->len));
+		request.touch.message.body.expiration = htobe32((uint32_t)expiration);
+		iov[0].iov_len = sizeof(request.touch.bytes);
+	}
+
+	/* send request */
+	getsocket(L, m);
+	iov[0].iov_base = &request;
+	iovcnt = 1 + keyiov(k, &iov[1]);
+	sendmsgnosig(L, m, iov, iovcnt, 0);
+
+	/* push decode function */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
+
+	/* read response */
+	nret = recvresponse(L, m, &status, cas, NULL, MEMCACHED_EXTRAS | MEMCACHED_VALUE
+			| MEMCACHED_VALUE_BUFFER);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		if (nret != 2) {
+			return luaL_error(L, "protocol error");
+		}
+		s = lua_tolstring(L, -2, &len);
+		if (len != sizeof(itemflags)) {
+			return luaL_error(L, "protocol error");
+		}
+		memcpy(&itemflags, s, sizeof(itemflags));
+		itemflags = be32toh(itemflags);
+		lua_remove(L, -2);
+		*refresh = -1;
+		if (itemflags & MEMCACHED_FLAG_ENVELOPE) {
+			*refresh = xfetch(L, m, lua_touserdata(L, -1));
+		}
+		if (m->deltas > 0 && !(itemflags & MEMCACHED_FLAG_ENVELOPE)) {
+			/* keep the encoding as the base of deltas */
+			b = lua_touserdata(L, -1);
+			if (b->len > 0) {
+				lua_pushlstring(L, b->b, b->len);
+				cachedelta(L, m, k, *cas, lua_gettop(L));
+				lua_pop(L, 1);
+			}
+		}
+		if (m->sketch) {
+			track(m, k, (int64_t)((memcached_buffer_t *)lua_touserdata(L, -1))->len);
+		}
+		start = m->timed ? clockns() : 0;
+		lua_call(L, 1, 1);
+		if (m->timed) {
+			m->codec += clockns() - start;
+		}
+		tally(m, MEMCACHED_TALLY_HITS, 1);
+		opend(L, m, MEMCACHED_METRIC_GET, k, &t);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		lua_pop(L, nret + 1);
+		tally(m, MEMCACHED_TALLY_MISSES, 1);
+		if (m->sketch) {
+			track(m, k, -1);
+		}
+		opend(L, m, MEMCACHED_METRIC_GET, k, &t);
+		return 0;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int decodeitem (lua_State *L, memcached_t *m, int nret) {
+	int          ok;
+	size_t       len;
+	uint64_t     start;
+	uint32_t     itemflags;
+	const char  *s;
+
+	/* replace the item flags and value buffer of a pipelined get with the decoded value; on
+	 * failure, with the error, so the caller can drain the pipeline before raising it */
+	tally(m, MEMCACHED_TALLY_HITS, 1);
+	if (nret != 2) {
+		return luaL_error(L, "protocol error");
+	}
+	s = lua_tolstring(L, -2, &len);
+	if (len != sizeof(itemflags)) {
+		return luaL_error(L, "protocol error");
+	}
+	memcpy(&itemflags, s, sizeof(itemflags));
+	itemflags = be32toh(itemflags);
+	lua_remove(L, -2);
+	if (itemflags & MEMCACHED_FLAG_ENVELOPE) {
+		xfetch(L, m, lua_touserdata(L, -1));
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
+	lua_insert(L, -2);
+	start = m->timed ? clockns() : 0;
+	ok = lua_pcall(L, 1, 1, 0) == LUA_OK;
+	if (m->timed) {
+		m->codec += clockns() - start;
+	}
+	return ok;
+}
+
+static int touchkey (lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration,
+		uint16_t *status, uint64_t *cas, int timed) {
+	struct iovec                   iov[1 + MEMCACHED_KEY_IOVCNT];
+	protocol_binary_request_touch  request;
+	optimer_t                      t;
+
+	/* prepare request; untimed touches are part of a timed operation */
+	if (timed) {
+		opstart(m, &t);
+	}
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_TOUCH_EXTRAS;
+	request.message.header.request.keylen = htobe16((uint16_t)k->len);
+	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_TOUCH_EXTRAS
+			+ k->len));
+	request.message.body.expiration = htobe32((uint32_t)expiration);
+
+	/* send request */
+	getsocket(L, m);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request.bytes);
+	sendmsgnosig(L, m, iov, 1 + keyiov(k, &iov[1]), 0);
+
+	/* read response */
+	lua_pop(L, recvresponse(L, m, status, cas, NULL, 0));
+	if (timed) {
+		opend(L, m, MEMCACHED_METRIC_TOUCH, k, &t);
+	}
+	return 0;
+}
+
+static void pushkey (lua_State *L, mkey_t *k) {
+	lua_pushlstring(L, k->prefix ? k->prefix : "", k->prefixlen);
+	lua_pushlstring(L, k->ns ? k->ns : "", k->nslen);
+	lua_pushlstring(L, k->key, k->keylen);
+	lua_concat(L, 3);
+}
+
+static void dedupwrite (lua_State *L, memcached_t *m, int index, uint64_t hash, uint64_t cas) {
+	char  rec[2 * sizeof(uint64_t)];
+
+	/* start over when full, which bounds the table */
+	if (m->dedup_index == LUA_NOREF || m->dedupcount >= m->dedup) {
+		if (m->dedup_index != LUA_NOREF) {
+			luaL_unref(L, LUA_REGISTRYINDEX, m->dedup_index);
+		}
+		lua_newtable(L);
+		m->dedup_index = luaL_ref(L, LUA_REGISTRYINDEX);
+		m->dedupcount = 0;
+	}
+	memcpy(&rec[0], &hash, sizeof(hash));
+	memcpy(&rec[sizeof(hash)], &cas, sizeof(cas));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->dedup_index);
+	lua_pushvalue(L, index);
+	lua_pushlstring(L, rec, sizeof(rec));
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	m->dedupcount++;
+}
+
+static int store (lua_State *L, memcached_t *m, uint8_t opcode, mkey_t *k, int index,
+		lua_Integer expiration, lua_Integer ttl, lua_Number delta, uint64_t *cas,
+		uint16_t *status) {
+	int                             iovcnt, dedup;
+	size_t                          valuelen, envelopelen;
+	uint64_t                        hash, h2, dcas;
+	const char                     *value, *rec;
+	struct iovec                    iov[1 + MEMCACHED_KEY_IOVCNT + 2];
+	char                            e[MEMCACHED_ENVELOPE_SIZE];
+	protocol_binary_request_set     srequest;
+	protocol_binary_request_delete  drequest;
+	optimer_t                       t;
+
+	/* handle both set and delete */
+	opstart(m, &t);
+	dedup = 0;
+	hash = 0;
+	if (!lua_isnil(L, index)) {
+		/* plain sets of values without an envelope are deduplicated, keyed by the wire key */
+		dedup = m->dedup > 0 && opcode == PROTOCOL_BINARY_CMD_SET && *cas == 0
+				&& !(m->xfetch > 0 && ttl > 0);
+		if (dedup) {
+			pushkey(L, k);
+		}
+
+		/* encode */
+		encodevalue(L, m, index, 0, &value, &valuelen);
+		if (valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + k->len
+				+ MEMCACHED_ENVELOPE_SIZE)) {
+			return luaL_error(L, "encoded value too long");
+		}
+		if (m->sketch) {
+			track(m, k, (int64_t)valuelen);
+		}
+
+		/* skip unchanged values, provided the item is unchanged since it was written */
+		if (dedup) {
+			hashkey(value, valuelen, &hash, &h2);
+			if (m->dedup_index != LUA_NOREF) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, m->dedup_index);
+				lua_pushvalue(L, -3);
+				lua_rawget(L, -2);
+				rec = lua_tostring(L, -1);
+				if (rec && memcmp(rec, &hash, sizeof(hash)) == 0) {
+					memcpy(&dcas, &rec[sizeof(hash)], sizeof(dcas));
+					lua_pop(L, 2);
+					touchkey(L, m, k, expiration, status, cas, 0);
+					if (*status == PROTOCOL_BINARY_RESPONSE_SUCCESS && *cas == dcas) {
+						lua_pop(L, 2);  /* encoding, key */
+						opend(L, m, MEMCACHED_METRIC_SET, k, &t);
+						return 0;
+					}
+					*cas = 0;
+				} else {
+					lua_pop(L, 2);
+				}
+			}
+		}
+
+		/* prepare envelope */
+		envelopelen = 0;
+		if (m->xfetch > 0 && ttl > 0) {
+			envelope(e, ttl, delta);
+			envelopelen = MEMCACHED_ENVELOPE_SIZE;
+		}
+
+		/* prepare request */
+		memset(&srequest, 0, sizeof(srequest));
+		srequest.message.header.request.magic = PROTOCOL_BINARY_REQ;
+		srequest.message.header.request.opcode = opcode;
+		srequest.message.header.request.extlen = MEMCACHED_REQUEST_SET_EXTRAS;
+		srequest.message.header.request.keylen = htobe16((uint16_t)k->len);
+		srequest.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_SET_EXTRAS
+				+ k->len + valuelen + envelopelen));
+		srequest.message.header.request.cas = htobe64(*cas);
+		if (envelopelen) {
+			srequest.message.body.flags = htobe32(MEMCACHED_FLAG_ENVELOPE);
+		}
+		srequest.message.body.expiration = htobe32((uint32_t)expiration);
+
+		/* send request */
+		getsocket(L, m);
+		iov[0].iov_base = &srequest;
+		iov[0].iov_len = sizeof(srequest.bytes);
+		iovcnt = 1 + keyiov(k, &iov[1]);
+		iov[iovcnt].iov_base = (void *)value;
+		iov[iovcnt++].iov_len = valuelen;
+		if (envelopelen) {
+			iov[iovcnt].iov_base = e;
+			iov[iovcnt++].iov_len = envelopelen;
+		}
+		sendmsgnosig(L, m, iov, iovcnt, 0);
+		lua_pop(L, 1);  /* encoding */
+	} else {
+		/* prepare request */
+		if (m->sketch) {
+			track(m, k, -1);
+		}
+		memset(&drequest, 0, sizeof(drequest));
+		drequest.message.header.request.magic = PROTOCOL_BINARY_REQ;
+		drequest.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETE;
+		drequest.message.header.request.extlen = MEMCACHED_REQUEST_DELETE_EXTRAS;
+		drequest.message.header.request.keylen = htobe16((uint16_t)k->len);
+		drequest.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_DELETE_EXTRAS
+				+ k->len));
+		drequest.message.header.request.cas = htobe64(*cas);
+
+		/* send request */
+		getsocket(L, m);
+		iov[0].iov_base = &drequest;
+		iov[0].iov_len = sizeof(drequest.bytes);
+		iovcnt = 1 + keyiov(k, &iov[1]);
+		sendmsgnosig(L, m, iov, iovcnt, 0);
+	}
+
+	/* read response */
+	lua_pop(L, recvresponse(L, m, status, cas, NULL, 0));
+
+	/* record deduplicated writes */
+	if (dedup) {
+		if (*status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			dedupwrite(L, m, lua_gettop(L), hash, *cas);
+		}
+		lua_pop(L, 1);  /* key */
+	}
+	opend(L, m, MEMCACHED_METRIC_SET, k, &t);
+	return 0;
+}
+
+static int get (lua_State *L) {
+	int           refresh;
+	uint64_t      cas;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+
+	/* get */
+	if (!fetch(L, m, &k, -1, &cas, &refresh)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, cas);
+	if (refresh >= 0 && m->xfetch > 0) {
+		lua_pushboolean(L, refresh);
+		return 3;
+	}
+	return 2;
+}
+
+static int setasync (lua_State *L) {
+	int                           i, iovcnt;
+	char                         *queue;
+	size_t                        valuelen, len, cap;
+	const char                   *value;
+	lua_Integer                   expiration, ttl;
+	struct iovec                  iov[MEMCACHED_KEY_IOVCNT];
+	mkey_t                        k;
+	memcached_t                  *m;
+	protocol_binary_request_set   request;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	luaL_argcheck(L, !lua_isnoneornil(L, 3), 3, "value required");
+	expiration = checkexpiration(L, m, 4, &ttl);
+	lua_settop(L, 4);
+	if (m->closed) {
+		return luaL_error(L, "closed");
+	}
+
+	/* encode */
+	encodevalue(L, m, 3, 0, &value, &valuelen);
+	if (valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + k.len)) {
+		return luaL_error(L, "encoded value too long");
+	}
+	len = sizeof(request.bytes) + k.len + valuelen;
+
+	/* send queued writes if the queue would exceed its limit; wait for their responses if too
+	 * many writes are unacknowledged, which bounds the keys kept for error reporting */
+	if (((m->seq - m->acked) & MEMCACHED_SEQ_MASK) >= MEMCACHED_PENDING_MAX) {
+		syncqueued(L, m);
+	} else if (m->queuelen > 0 && m->queuelen + len > (size_t)m->queuelimit) {
+		getsocket(L, m);
+	}
+
+	/* grow queue as needed */
+	if (m->queuelen + len > m->queuecap) {
+		cap = m->queuecap > 0 ? m->queuecap : MEMCACHED_BUFFER_SIZE;
+		while (cap < m->queuelen + len) {
+			cap *= 2;
+		}
+		queue = realloc(m->queue, cap);
+		if (queue == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		m->queue = queue;
+		m->queuecap = cap;
+	}
+
+	/* queue quiet set request; the opaque identifies the write in case of failure */
+	m->seq = (m->seq + 1) & MEMCACHED_SEQ_MASK;
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SETQ;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_SET_EXTRAS;
+	request.message.header.request.keylen = htobe16((uint16_t)k.len);
+	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_SET_EXTRAS
+			+ k.len + valuelen));
+	request.message.header.request.opaque = MEMCACHED_OPAQUE_ASYNC | m->seq;
+	request.message.body.expiration = htobe32((uint32_t)expiration);
+	memcpy(&m->queue[m->queuelen], request.bytes, sizeof(request.bytes));
+	m->queuelen += sizeof(request.bytes);
+	iovcnt = keyiov(&k, iov);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&m->queue[m->queuelen], iov[i].iov_base, iov[i].iov_len);
+		m->queuelen += iov[i].iov_len;
+	}
+	memcpy(&m->queue[m->queuelen], value, valuelen);
+	m->queuelen += valuelen;
+
+	/* remember the key for error reporting */
+	if (m->pending_index == LUA_NOREF) {
+		lua_newtable(L);
+		m->pending_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->pending_index);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, m->seq);
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int flushpending (lua_State *L) {
+	memcached_t  *m;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+
+	/* send queued writes, and wait for their responses */
+	if (m->queuelen > 0 || m->sent != m->acked) {
+		syncqueued(L, m);
+	}
+
+	/* return and reset the failed writes */
+	if (m->errors_index != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->errors_index);
+		luaL_unref(L, LUA_REGISTRYINDEX, m->errors_index);
+		m->errors_index = LUA_NOREF;
+	} else {
+		lua_newtable(L);
+	}
+	return 1;
+}
+
+static int gat (lua_State *L) {
+	int           refresh;
+	uint64_t      cas;
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	expiration = checkexpiration(L, m, 3, &ttl);
+
+	/* get and touch */
+	if (!fetch(L, m, &k, expiration, &cas, &refresh)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, cas);
+	return 2;
+}
+
+static int touch (lua_State *L) {
+	uint16_t      status;
+	uint64_t      cas;
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	expiration = checkexpiration(L, m, 3, &ttl);
+
+	/* touch */
+	touchkey(L, m, &k, expiration, &status, &cas, 1);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushboolean(L, 1);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		lua_pushboolean(L, 0);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int touchmulti (lua_State *L) {
+	int           nret;
+	size_t        n, i;
+	uint16_t      status;
+	uint32_t      opaque;
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	op_t         *ops;
+	optimer_t     t;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	expiration = checkexpiration(L, m, 3, &ttl);
+	lua_settop(L, 3);
+
+	/* prepare requests */
+	opstart(m, &t);
+	n = lua_rawlen(L, 2);
+	luaL_argcheck(L, n < MEMCACHED_OPAQUE_ASYNC, 2, "too many keys");
+	ops = lua_newuserdata(L, n * sizeof(op_t) + 1);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 2, (lua_Integer)i + 1);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "bad key");
+		ops[i].k = k;
+		checkkey(L, m, lua_gettop(L), &ops[i].k);
+		opinit(&ops[i], PROTOCOL_BINARY_CMD_TOUCH, MEMCACHED_REQUEST_TOUCH_EXTRAS, 0,
+				(uint32_t)i);
+		ops[i].request.touch.message.body.expiration = htobe32((uint32_t)expiration);
+		lua_pop(L, 1);
+	}
+
+	/* send requests */
+	sendops(L, m, ops, n);
+
+	/* read responses */
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, 0);
+		lua_pop(L, nret);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			break;
+		}
+		if (opaque >= n) {
+			return luaL_error(L, "protocol error");
+		}
+		ops[opaque].status = status;
+	}
+
+	/* return results, by key */
+	lua_createtable(L, 0, n <= INT_MAX ? (int)n : INT_MAX);
+	for (i = 0; i < n; i++) {
+		switch (ops[i].status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+			lua_rawgeti(L, 2, (lua_Integer)i + 1);
+			lua_pushboolean(L, ops[i].status == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+			lua_rawset(L, -3);
+			break;
+
+		case MEMCACHED_STATUS_NONE:
+			return luaL_error(L, "protocol error");
+
+		default:
+			return luaL_error(L, "memcached error (%d)", (int)ops[i].status);
+		}
+	}
+	opend(L, m, MEMCACHED_METRIC_MULTI, NULL, &t);
+	return 1;
+}
+
+static int set (lua_State *L) {
+	uint16_t      status;
+	uint64_t      cas;
+	lua_Integer   expiration, ttl;
+	lua_Number    delta;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	if (lua_tointeger(L, lua_upvalueindex(1)) == PROTOCOL_BINARY_CMD_SET) {
+		luaL_checkany(L, 3);
+	} else {
+		luaL_argcheck(L, !lua_isnoneornil(L, 3), 3, "value required");
+	}
+	expiration = checkexpiration(L, m, 4, &ttl);
+	cas = luaL_optinteger(L, 5, 0);
+	delta = luaL_optnumber(L, 6, 0);
+	luaL_argcheck(L, delta >= 0, 6, "bad delta");
+
+	/* set or delete */
+	store(L, m, (uint8_t)lua_tointeger(L, lua_upvalueindex(1)), &k, 3, expiration, ttl, delta,
+			&cas, &status);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, cas);
+		return 2;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+		lua_pushboolean(L, 0);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int update (lua_State *L) {
+	int           attempts, backoff_ms, refresh;
+	uint16_t      status;
+	uint64_t      cas;
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	expiration = checkexpiration(L, m, 4, &ttl);
+	attempts = (int)luaL_optinteger(L, 5, 5);
+	luaL_argcheck(L, attempts > 0, 5, "bad attempts");
+	lua_settop(L, 5);
+
+	/* read, modify, and write until there is no conflict */
+	backoff_ms = 0;
+	while (1) {
+		lua_pushvalue(L, 3);
+		if (!fetch(L, m, &k, -1, &cas, &refresh)) {
+			lua_pushnil(L);
+			cas = 0;
+		}
+		lua_call(L, 1, 1);
+		if (lua_isnil(L, -1)) {
+			return 1;
+		}
+		store(L, m, cas ? PROTOCOL_BINARY_CMD_SET : PROTOCOL_BINARY_CMD_ADD, &k, 6, expiration,
+				ttl, 0, &cas, &status);
+		switch (status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+			lua_pushinteger(L, cas);
+			return 2;
+
+		case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+		case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* conflict */
+			if (--attempts == 0) {
+				return luaL_error(L, "memcached error (%d)", (int)status);
+			}
+			lua_pop(L, 1);
+			retrywait(L, &backoff_ms);
+			break;
+
+		default:
+			return luaL_error(L, "memcached error (%d)", (int)status);
+		}
+	}
+}
+
+static int increment (lua_State *L, memcached_t *m, uint8_t opcode, mkey_t *k, lua_Integer delta,
+		lua_Integer initial, lua_Integer expiration, uint16_t *status, uint64_t *value) {
+	int                           nret, iovcnt, attempts, backoff_ms;
+	size_t                        len;
+	const char                   *s;
+	struct iovec                  iov[1 + MEMCACHED_KEY_IOVCNT];
+	protocol_binary_request_incr  request;
+	optimer_t                     t;
+
+	/* prepare request */
+	opstart(m, &t);
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = opcode;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_INCR_EXTRAS;
+	request.message.header.request.keylen = htobe16((uint16_t)k->len);
+	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_INCR_EXTRAS
+			+ k->len));
+	request.message.body.delta = htobe64((uint64_t)delta);
+	request.message.body.initial = htobe64((uint64_t)initial);
+	request.message.body.expiration = htobe32((uint32_t)expiration);
+
+	/* prepare sending */
+	attempts = 3;
+	backoff_ms = 0;
+	getsocket(L, m);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request.bytes);
+	iovcnt = 1 + keyiov(k, &iov[1]);
+
+	/* send request */
+	redo:
+	sendmsgnosig(L, m, iov, iovcnt, 0);
+
+	/* read response */
+	nret = recvresponse(L, m, status, NULL, NULL, MEMCACHED_VALUE);
+	switch (*status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		if (nret != 1) {
+			return luaL_error(L, "protocol error");
+		}
+		s = lua_tolstring(L, -1, &len);
+		if (len != sizeof(*value)) {
+			return luaL_error(L, "protocol error");
+		}
+		memcpy(value, s, sizeof(*value));
+		*value = be64toh(*value);
+		lua_pop(L, 1);
+		opend(L, m, MEMCACHED_METRIC_INC, k, &t);
+		return 0;
+
+	case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* race condition */
+		lua_pop(L, nret);
+		if (--attempts == 0) {
+			opend(L, m, MEMCACHED_METRIC_INC, k, &t);
+			return 0;
+		}
+		retrywait(L, &backoff_ms);
+		goto redo;
+
+	default:
+		lua_pop(L, nret);
+		opend(L, m, MEMCACHED_METRIC_INC, k, &t);
+		return 0;
+	}
+}
+
+static int incr (lua_State *L) {
+	uint16_t      status;
+	uint64_t      value;
+	lua_Integer   delta, initial, expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	delta = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, delta >= 0 && delta <= INT64_MAX, 3, "bad delta");
+	initial = luaL_optinteger(L, 4, 1);
+	luaL_argcheck(L, initial >= 0 && initial <= INT64_MAX, 4, "bad initial value");
+	expiration = checkexpiration(L, m, 5, &ttl);
+
+	/* increment or decrement */
+	increment(L, m, (uint8_t)lua_tointeger(L, lua_upvalueindex(1)), &k, delta, initial,
+			expiration, &status, &value);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushinteger(L, (lua_Integer)value);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL:
+		lua_pushnil(L);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static void pruneratelimits (lua_State *L, memcached_t *m) {
+	lua_Integer   now;
+	ratelimit_t  *r;
+
+	/* drop the rate limits of past windows; start over if still full, which bounds the cache */
+	now = (lua_Integer)(clockms(CLOCK_REALTIME) / 1000);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->ratelimits_index);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		r = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (r->window != now / r->length) {
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+			m->ratelimitcount--;
+		}
+	}
+	lua_pop(L, 1);
+	if (m->ratelimitcount >= MEMCACHED_RATELIMITS) {
+		lua_newtable(L);
+		lua_rawseti(L, LUA_REGISTRYINDEX, m->ratelimits_index);
+		m->ratelimitcount = 0;
+	}
+}
+
+static int ratelimit (lua_State *L) {
+	uint16_t      status;
+	uint64_t      value;
+	lua_Integer   limit, window, wid, lease, count;
+	mkey_t        k;
+	memcached_t  *m;
+	ratelimit_t  *r;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	luaL_checkstring(L, 2);
+	limit = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, limit >= 0, 3, "bad limit");
+	window = luaL_checkinteger(L, 4);
+	luaL_argcheck(L, window > 0 && window <= MEMCACHED_TTL_MAX, 4, "bad window");
+	lua_settop(L, 4);
+	wid = (lua_Integer)(clockms(CLOCK_REALTIME) / 1000) / window;
+
+	/* get cache entry */
+	if (m->ratelimits_index == LUA_NOREF) {
+		lua_newtable(L);
+		m->ratelimits_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->ratelimits_index);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 5);
+	r = lua_touserdata(L, 6);
+	if (!r) {
+		lua_pop(L, 1);
+		if (m->ratelimitcount >= MEMCACHED_RATELIMITS) {
+			pruneratelimits(L, m);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, m->ratelimits_index);
+			lua_replace(L, 5);
+		}
+		r = lua_newuserdata(L, sizeof(ratelimit_t));
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, 6);
+		lua_rawset(L, 5);
+		m->ratelimitcount++;
+		r->window = -1;
+	}
+	r->length = window;
+	if (r->window != wid) {
+		r->window = wid;
+		r->count = 0;
+		r->tokens = 0;
+	}
+
+	/* serve from leased tokens, or deny if the limit is known to be reached */
+	if (r->tokens > 0) {
+		r->tokens--;
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, (r->count < limit ? limit - r->count : 0) + r->tokens);
+		return 2;
+	}
+	if (r->count >= limit && r->count > 0) {
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, 0);
+		return 2;
+	}
+
+	/* lease more than one token if clearly under the limit */
+	lease = 1;
+	if (r->count > 0 && r->count < limit / 2) {
+		lease += (limit / 2 - r->count) / 8;
+	}
+
+	/* increment the window key, creating it as needed */
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	lua_pushvalue(L, 2);
+	lua_pushfstring(L, ":%I", wid);
+	lua_concat(L, 2);
+	checkkey(L, m, 7, &k);
+	increment(L, m, PROTOCOL_BINARY_CMD_INCREMENT, &k, lease, lease, window, &status, &value);
+	if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+
+	/* grant the leased tokens within the limit */
+	count = value <= INT64_MAX ? (lua_Integer)value : INT64_MAX;
+	r->count = count;
+	if (count - lease >= limit) {
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, 0);
+		return 2;
+	}
+	r->tokens = (count <= limit ? lease : limit - (count - lease)) - 1;
+	lua_pushboolean(L, 1);
+	lua_pushinteger(L, (count < limit ? limit - count : 0) + r->tokens);
+	return 2;
+}
+
+static int same (lua_State *L, int index1, int index2) {
+	if (lua_type(L, index1) != lua_type(L, index2)) {
+		return 0;
+	}
+	if (lua_type(L, index1) == LUA_TNUMBER && lua_isinteger(L, index1)
+			!= lua_isinteger(L, index2)) {
+		return 0;
+	}
+	return lua_rawequal(L, index1, index2);
+}
+
+static int diff (lua_State *L, int oindex, int nindex, int depth) {
+	int  pindex, r;
+	int  nset, ndel, npatch;
+
+	/* tables as keys, and deep nesting, cannot be diffed */
+	if (depth > MEMCACHED_DIFF_DEPTH) {
+		return -1;
+	}
+	luaL_checkstack(L, 8, "computing diff");
+
+	/* prepare patch, and its set, delete, and nested patch tables */
+	lua_newtable(L);
+	pindex = lua_gettop(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	nset = ndel = npatch = 0;
+
+	/* set changed and added pairs, and patch nested tables */
+	lua_pushnil(L);
+	while (lua_next(L, nindex)) {
+		if (!supported(L, -2) || !supported(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		if (lua_type(L, -2) == LUA_TTABLE) {
+			lua_settop(L, pindex - 1);
+			return -1;
+		}
+		lua_pushvalue(L, -2);
+		lua_rawget(L, oindex);
+		if (lua_istable(L, -1) && lua_istable(L, -2)) {
+			r = diff(L, lua_gettop(L), lua_gettop(L) - 1, depth + 1);
+			if (r < 0) {
+				lua_settop(L, pindex - 1);
+				return -1;
+			}
+			if (r > 0) {
+				lua_pushvalue(L, -4);
+				lua_insert(L, -2);
+				lua_rawset(L, pindex + 3);
+				npatch++;
+			}
+			lua_pop(L, 2);
+		} else if (!same(L, -1, -2)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, pindex + 1);
+			nset++;
+		} else {
+			lua_pop(L, 2);
+		}
+	}
+
+	/* delete removed pairs */
+	lua_pushnil(L);
+	while (lua_next(L, oindex)) {
+		lua_pop(L, 1);
+		if (!supported(L, -1)) {
+			continue;
+		}
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			lua_settop(L, pindex - 1);
+			return -1;
+		}
+		lua_pushvalue(L, -1);
+		lua_rawget(L, nindex);
+		if (!supported(L, -1)) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, pindex + 2, ++ndel);
+		}
+		lua_pop(L, 1);
+	}
+
+	/* assemble patch */
+	if (nset + ndel + npatch == 0) {
+		lua_settop(L, pindex - 1);
+		return 0;
+	}
+	if (npatch > 0) {
+		lua_setfield(L, pindex, "p");
+	} else {
+		lua_pop(L, 1);
+	}
+	if (ndel > 0) {
+		lua_setfield(L, pindex, "d");
+	} else {
+		lua_pop(L, 1);
+	}
+	if (nset > 0) {
+		lua_setfield(L, pindex, "s");
+	} else {
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int defaultcodec (lua_State *L, memcached_t *m) {
+	int  result;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->encode_index);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->decode_index);
+	result = lua_tocfunction(L, -2) == mencode && lua_tocfunction(L, -1) == mdecode;
+	lua_pop(L, 2);
+	return result;
+}
+
+static void cachedelta (lua_State *L, memcached_t *m, mkey_t *k, uint64_t cas, int index) {
+	char    key[MEMCACHED_KEY_MAX];
+	size_t  len, keylen;
+
+	/* start over when full, which bounds the cache by size */
+	len = sizeof(cas) + lua_rawlen(L, index);
+	if (len > (size_t)m->deltas) {
+		return;
+	}
+	if (m->deltas_index == LUA_NOREF || m->deltasize + len > (size_t)m->deltas) {
+		if (m->deltas_index != LUA_NOREF) {
+			luaL_unref(L, LUA_REGISTRYINDEX, m->deltas_index);
+		}
+		lua_newtable(L);
+		m->deltas_index = luaL_ref(L, LUA_REGISTRYINDEX);
+		m->deltasize = 0;
+	}
+
+	/* replace the base of the key, as the CAS value followed by the encoding */
+	keylen = copykey(k, key, sizeof(key));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->deltas_index);
+	lua_pushlstring(L, key, keylen);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	m->deltasize -= lua_rawlen(L, -1);
+	lua_pop(L, 1);
+	lua_pushlstring(L, (const char *)&cas, sizeof(cas));
+	lua_pushvalue(L, index);
+	lua_concat(L, 2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	m->deltasize += len;
+}
+
+static int setdelta (lua_State *L) {
+	int                  nret;
+	char                 key[MEMCACHED_KEY_MAX];
+	size_t               snapshot, len, keylen;
+	const char          *s;
+	uint16_t             status;
+	uint32_t             opaque;
+	uint64_t             cas;
+	lua_Integer          expiration, ttl;
+	mkey_t               k;
+	memcached_t         *m;
+	memcached_buffer_t  *b, bs;
+	op_t                 op;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	luaL_checkany(L, 3);
+	cas = (uint64_t)luaL_checkinteger(L, 4);
+	expiration = checkexpiration(L, m, 5, &ttl);
+	lua_settop(L, 5);
+
+	/* get the base encoding, as read with the CAS; deltas require the default codec */
+	if (m->deltas_index != LUA_NOREF && lua_istable(L, 3) && defaultcodec(L, m)) {
+		keylen = copykey(&k, key, sizeof(key));
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m->deltas_index);
+		lua_pushlstring(L, key, keylen);
+		lua_rawget(L, 6);
+	}
+	if (lua_gettop(L) == 7 && lua_type(L, 7) == LUA_TSTRING) {
+		/* decode base, and diff */
+		s = lua_tolstring(L, 7, &len);
+		if (len < sizeof(cas) || memcmp(s, &cas, sizeof(cas)) != 0) {
+			goto full;
+		}
+		bs.b = (char *)s + sizeof(cas);
+		bs.len = len - sizeof(cas);
+		bs.capacity = bs.len;
+		bs.pos = 0;
+		if (bs.len < sizeof(MEMCACHED_CODEC_VERSION) - 1 || memcmp(bs.b, MEMCACHED_CODEC_VERSION,
+				sizeof(MEMCACHED_CODEC_VERSION) - 1) != 0) {
+			goto full;
+		}
+		decodeencoding(L, &bs, &snapshot);
+		if (!lua_istable(L, -1)) {
+			goto full;
+		}
+		switch (diff(L, lua_gettop(L), 3, 0)) {
+		case 0:
+			/* unchanged */
+			lua_pushboolean(L, 1);
+			lua_pushinteger(L, (lua_Integer)cas);
+			return 2;
+
+		case 1:
+			break;
+
+		default:
+			goto full;
+		}
+
+		/* append the patch, unless the patches outgrow the snapshot */
+		encodeframe(L, lua_gettop(L), MEMCACHED_CODEC_PATCH, m->canonical);
+		b = lua_touserdata(L, -1);
+		if (bs.len + b->pos > 2 * snapshot
+				|| b->pos > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + k.len)) {
+			goto full;
+		}
+		op.k = k;
+		if (k.key == k.buf) {
+			op.k.key = op.k.buf;  /* hashed key */
+		}
+		opinit(&op, PROTOCOL_BINARY_CMD_APPEND, 0, b->pos, 0);
+		op.request.header.request.cas = htobe64(cas);
+		op.value = b->b;
+		op.valuelen = b->pos;
+		sendops(L, m, &op, 1);
+		while (1) {
+			nret = recvresponse(L, m, &status, &cas, &opaque, 0);
+			lua_pop(L, nret);
+			if (opaque == MEMCACHED_OPAQUE_NOOP) {
+				break;
+			}
+			op.status = status;
+			op.cas = cas;
+		}
+		switch (op.status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+			/* the base of the next delta is the base with the patch */
+			lua_pushlstring(L, bs.b, bs.len);
+			lua_pushlstring(L, b->b, b->pos);
+			lua_concat(L, 2);
+			cachedelta(L, m, &k, op.cas, lua_gettop(L));
+			lua_pushboolean(L, 1);
+			lua_pushinteger(L, (lua_Integer)op.cas);
+			return 2;
+
+		case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+		case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+		case PROTOCOL_BINARY_RESPONSE_NOT_STORED:
+			lua_pushboolean(L, 0);
+			return 1;
+
+		default:
+			return luaL_error(L, "memcached error (%d)", (int)op.status);
+		}
+	}
+
+full:
+	/* set a full snapshot */
+	store(L, m, PROTOCOL_BINARY_CMD_SET, &k, 3, expiration, ttl, 0, &cas, &status);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, (lua_Integer)cas);
+		return 2;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+		lua_pushboolean(L, 0);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int incmulti (lua_State *L) {
+	int           values, isinteger, nret, attempts, backoff_ms;
+	size_t        n, i, j, len, nretry;
+	uint8_t       opcode;
+	uint16_t      status;
+	uint32_t      opaque;
+	const char   *s;
+	lua_Integer   delta, initial, expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	op_t         *ops, *retry;
+	optimer_t     t;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	initial = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, initial >= 0 && initial <= INT64_MAX, 3, "bad initial value");
+	expiration = checkexpiration(L, m, 4, &ttl);
+	values = lua_toboolean(L, 5);
+	lua_settop(L, 5);
+
+	/* prepare requests; negative deltas decrement */
+	opstart(m, &t);
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		n++;
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, n < MEMCACHED_OPAQUE_ASYNC, 2, "too many keys");
+	ops = lua_newuserdata(L, n * sizeof(op_t) + 1);
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 2, "bad key");
+		ops[i].k = k;
+		checkkey(L, m, lua_gettop(L) - 1, &ops[i].k);
+		delta = lua_tointegerx(L, -1, &isinteger);
+		luaL_argcheck(L, isinteger && delta != LUA_MININTEGER, 2, "bad delta");
+		if (delta >= 0) {
+			opcode = values ? PROTOCOL_BINARY_CMD_INCREMENT : PROTOCOL_BINARY_CMD_INCREMENTQ;
+		} else {
+			opcode = values ? PROTOCOL_BINARY_CMD_DECREMENT : PROTOCOL_BINARY_CMD_DECREMENTQ;
+			delta = -delta;
+		}
+		opinit(&ops[i], opcode, MEMCACHED_REQUEST_INCR_EXTRAS, 0, (uint32_t)i);
+		ops[i].request.incr.message.body.delta = htobe64((uint64_t)delta);
+		ops[i].request.incr.message.body.initial = htobe64((uint64_t)initial);
+		ops[i].request.incr.message.body.expiration = htobe32((uint32_t)expiration);
+		lua_pop(L, 1);
+		i++;
+	}
+
+	/* send requests, retrying races while creating keys */
+	attempts = 3;
+	backoff_ms = 0;
+	retry = ops;
+	nretry = n;
+	while (1) {
+		sendops(L, m, retry, nretry);
+
+		/* read responses; quiet requests only respond on failure */
+		while (1) {
+			nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_VALUE);
+			if (opaque == MEMCACHED_OPAQUE_NOOP) {
+				lua_pop(L, nret);
+				break;
+			}
+			if (opaque >= n) {
+				return luaL_error(L, "protocol error");
+			}
+			ops[opaque].status = status;
+			if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+				s = lua_tolstring(L, -1, &len);
+				if (nret != 1 || len != sizeof(ops[opaque].number)) {
+					return luaL_error(L, "protocol error");
+				}
+				memcpy(&ops[opaque].number, s, sizeof(ops[opaque].number));
+				ops[opaque].number = be64toh(ops[opaque].number);
+			}
+			lua_pop(L, nret);
+		}
+
+		/* collect the races, keeping their opaque values */
+		nretry = 0;
+		for (i = 0; i < n; i++) {
+			if (ops[i].status == PROTOCOL_BINARY_RESPONSE_NOT_STORED) {
+				nretry++;
+			}
+		}
+		if (nretry == 0 || --attempts == 0) {
+			break;
+		}
+		if (retry == ops) {
+			retry = lua_newuserdata(L, nretry * sizeof(op_t));
+		}
+		j = 0;
+		for (i = 0; i < n; i++) {
+			if (ops[i].status == PROTOCOL_BINARY_RESPONSE_NOT_STORED) {
+				ops[i].status = MEMCACHED_STATUS_NONE;
+				retry[j] = ops[i];
+				if (ops[i].k.key == ops[i].k.buf) {
+					retry[j].k.key = retry[j].k.buf;  /* hashed key */
+				}
+				j++;
+			}
+		}
+		retrywait(L, &backoff_ms);
+	}
+
+	/* check status */
+	for (i = 0; i < n; i++) {
+		switch (ops[i].status) {
+		case MEMCACHED_STATUS_NONE:
+			if (values) {
+				return luaL_error(L, "protocol error");
+			}
+			break;
+
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL:
+			break;
+
+		case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* race condition, persisting */
+			if (!values) {
+				return luaL_error(L, "memcached error (%d)", (int)ops[i].status);
+			}
+			break;
+
+		default:
+			return luaL_error(L, "memcached error (%d)", (int)ops[i].status);
+		}
+	}
+	opend(L, m, MEMCACHED_METRIC_MULTI, NULL, &t);
+	if (!values) {
+		return 0;
+	}
+
+	/* return values, in the same traversal order */
+	lua_createtable(L, 0, n <= INT_MAX ? (int)n : INT_MAX);
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		if (ops[i].status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			lua_pushinteger(L, (lua_Integer)ops[i].number);
+		} else {
+			lua_pushboolean(L, 0);
+		}
+		lua_rawset(L, -4);
+		i++;
+	}
+	return 1;
+}
+
+static size_t concat (lua_State *L, memcached_t *m, op_t *ops, size_t n, uint8_t opcode,
+		lua_Integer expiration) {
+	int          nret, pass;
+	size_t       i, j, valuelen;
+	uint16_t     status, error;
+	uint32_t     opaque;
+	const char  *value;
+
+	/* alternate between appending to present keys and adding missing keys; quiet requests only
+	 * respond on failure */
+	error = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	for (pass = 0; n > 0 && pass < MEMCACHED_CONCAT_PASSES; pass++) {
+		/* prepare requests */
+		for (i = 0; i < n; i++) {
+			value = ops[i].value;
+			valuelen = ops[i].valuelen;
+			if (pass % 2 == 0) {
+				opinit(&ops[i], opcode, 0, valuelen, (uint32_t)i);
+			} else {
+				opinit(&ops[i], PROTOCOL_BINARY_CMD_ADDQ, MEMCACHED_REQUEST_SET_EXTRAS,
+						valuelen, (uint32_t)i);
+				ops[i].request.set.message.body.expiration = htobe32((uint32_t)expiration);
+			}
+			ops[i].value = value;
+			ops[i].valuelen = valuelen;
+		}
+
+		/* send requests */
+		sendops(L, m, ops, n);
+
+		/* read responses */
+		while (1) {
+			nret = recvresponse(L, m, &status, NULL, &opaque, 0);
+			lua_pop(L, nret);
+			if (opaque == MEMCACHED_OPAQUE_NOOP) {
+				break;
+			}
+			if (opaque >= n) {
+				return luaL_error(L, "protocol error");
+			}
+			ops[opaque].status = status;
+		}
+
+		/* keep the values not stored for the next pass */
+		j = 0;
+		for (i = 0; i < n; i++) {
+			switch (ops[i].status) {
+			case MEMCACHED_STATUS_NONE:
+				break;
+
+			case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+			case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+			case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* race condition */
+				if (j < i) {
+					ops[j] = ops[i];
+					if (ops[i].k.key == ops[i].k.buf) {
+						ops[j].k.key = ops[j].k.buf;  /* hashed key */
+					}
+				}
+				j++;
+				break;
+
+			default:
+				if (error == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+					error = ops[i].status;
+				}
+			}
+		}
+		if (error != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			return luaL_error(L, "memcached error (%d)", (int)error);
+		}
+		n = j;
+	}
+	return n;
+}
+
+static int append (lua_State *L) {
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	op_t         *op;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	checkkey(L, m, 2, &k);
+	luaL_argcheck(L, !lua_isnoneornil(L, 3), 3, "value required");
+	expiration = checkexpiration(L, m, 4, &ttl);
+	lua_settop(L, 4);
+
+	/* prepare request */
+	op = lua_newuserdata(L, sizeof(op_t));
+	op->k = k;
+	encodevalue(L, m, 3, 1, &op->value, &op->valuelen);
+	if (op->valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + k.len)) {
+		return luaL_error(L, "encoded value too long");
+	}
+
+	/* append or prepend */
+	lua_pushboolean(L, concat(L, m, op, 1, (uint8_t)lua_tointeger(L, lua_upvalueindex(1)),
+			expiration) == 0);
+	return 1;
+}
+
+static int appendmulti (lua_State *L) {
+	size_t        n, i;
+	lua_Integer   expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	op_t         *ops;
+
+	/* check arguments */
+	m = checkmemcached(L, 1, &k);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	expiration = checkexpiration(L, m, 3, &ttl);
+	lua_settop(L, 3);
+
+	/* prepare requests; the encodings are kept in a table */
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		n++;
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, n < MEMCACHED_OPAQUE_ASYNC, 2, "too many keys");
+	ops = lua_newuserdata(L, n * sizeof(op_t) + 1);
+	lua_createtable(L, n <= INT_MAX ? (int)n : INT_MAX, 0);
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 2, "bad key");
+		ops[i].k = k;
+		checkkey(L, m, lua_gettop(L) - 1, &ops[i].k);
+		encodevalue(L, m, lua_gettop(L), 1, &ops[i].value, &ops[i].valuelen);
+		if (ops[i].valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + ops[i].k.len)) {
+			return luaL_error(L, "encoded value too long");
+		}
+		lua_rawseti(L, 5, (lua_Integer)i + 1);
+		lua_pop(L, 1);
+		i++;
+	}
+
+	/* append or prepend */
+	lua_pushboolean(L, concat(L, m, ops, n, (uint8_t)lua_tointeger(L, lua_upvalueindex(1)),
+			expiration) == 0);
+	return 1;
+}
+
+static int flush (lua_State *L) {
+	uint16_t                       status;
+	lua_Integer                    expiration;
+	memcached_t                   *m;
+	protocol_binary_request_flush  request;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	expiration = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, expiration >= 0 && expiration <= UINT32_MAX, 2, "bad expiration");
+
+	/* prepare request */
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_FLUSH;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_FLUSH_EXTRAS;
+	request.message.header.request.bodylen = htobe32((uint32_t)MEMCACHED_REQUEST_FLUSH_EXTRAS);
+	request.message.body.expiration = htobe32((uint32_t)expiration);
+
+	/* send request */
+	getsocket(L, m);
+	sendnosig(L, m, &request, sizeof(request.bytes));
+
+	/* read response */
+	recvresponse(L, m, &status, NULL, NULL, 0);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		return 0;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int stats (lua_State *L) {
+	int                            nret;
+	size_t                         keylen;
+	uint16_t                       status;
+	const char                    *key;
+	memcached_t                   *m;
+	struct iovec                   iov[2];
+	protocol_binary_request_stats  request;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	key = luaL_optlstring(L, 2, NULL, &keylen);
+	luaL_argcheck(L, !key || (keylen > 0 && keylen <= UINT16_MAX), 2, "bad key length");
+
+	/* prepare request */
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_STAT;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_STATS_EXTRAS;
+	request.message.header.request.keylen = htobe16((uint16_t)keylen);
+	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_STATS_EXTRAS
+			+ keylen));
+
+	/* send request */
+	getsocket(L, m);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request.bytes);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = (uint16_t)keylen;
+	sendmsgnosig(L, m, iov, key ? 2 : 1, 0);
+
+	/* read response */
+	lua_newtable(L);
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, NULL, MEMCACHED_KEY
+				| MEMCACHED_VALUE);
+		switch (status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+			switch (nret) {
+			case 1:
+				lua_pop(L, 1);  /* pop empty value */
+				return 1;
+			
+			case 2:
+				lua_rawset(L, -3);
+				break;
+
+			default:
+				return luaL_error(L, "protocol error");
+			}
+			break;
+
+		default:
+			return luaL_error(L, "memcached error (%d)", (int)status);
+		}
+	}
+}
+
+static int quit (lua_State *L) {
+	memcached_t                   *m;
+	protocol_binary_request_quit  request;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+
+	/* prepare request */
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_QUITQ;
+
+	/* send request */
+	sendnosig(L, m, &request, sizeof(request.bytes));
+
+	return 0;
+}
+
+static int mclose (lua_State *L) {
+	memcached_t  *m;
+
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	if (!m->closed && m->counters_index != LUA_NOREF) {
+		/* flush counters */
+		lua_pushcfunction(L, flushall);
+		lua_pushvalue(L, 1);
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			/* ignore error, if any */
+			lua_pop(L, 1);
+		}
+	}
+	if (!m->closed && (m->queuelen > 0 || m->sent != m->acked)) {
+		/* flush queued writes */
+		lua_pushcfunction(L, flushpending);
+		lua_pushvalue(L, 1);
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			/* ignore error, if any */
+			lua_pop(L, 1);
+		}
+	}
+	m->closed = 1;
+	free(m->queue);
+	m->queue = NULL;
+	free(m->metrics);
+	m->metrics = NULL;
+	free(m->slowlog);
+	m->slowlog = NULL;
+	m->slowloghead = m->slowlogcount = 0;
+	free(m->sketch);
+	m->sketch = NULL;
+	m->timed = 0;
+	if (m->slowhandler_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->slowhandler_index);
+		m->slowhandler_index = LUA_NOREF;
+	}
+	m->queuelen = m->queuecap = 0;
+	if (m->pending_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->pending_index);
+		m->pending_index = LUA_NOREF;
+	}
+	if (m->errors_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->errors_index);
+		m->errors_index = LUA_NOREF;
+	}
+	if (m->prefetch_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->prefetch_index);
+		m->prefetch_index = LUA_NOREF;
+	}
+	if (m->counters_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->counters_index);
+		m->counters_index = LUA_NOREF;
+	}
+	if (m->ratelimits_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->ratelimits_index);
+		m->ratelimits_index = LUA_NOREF;
+	}
+	if (m->deltas_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->deltas_index);
+		m->deltas_index = LUA_NOREF;
+	}
+	if (m->dedup_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->dedup_index);
+		m->dedup_index = LUA_NOREF;
+	}
+	if (m->host_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->host_index);
+		m->host_index = LUA_NOREF;
+	}
+	if (m->port_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->port_index);
+		m->port_index = LUA_NOREF;
+	}
+	if (m->encode_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->encode_index);
+		m->encode_index = LUA_NOREF;
+	}
+	if (m->decode_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->decode_index);
+		m->decode_index = LUA_NOREF;
+	}
+	if (m->prefix_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, m->prefix_index);
+		m->prefix_index = LUA_NOREF;
+		m->prefix = NULL;
+		m->prefixlen = 0;
+	}
+	if (m->fd >= 0) {
+		/* send quit command */
+		lua_pushcfunction(L, quit);
+		lua_pushvalue(L, 1);
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			/* ignore error, if any */
+			lua_pop(L, 1);
+		}
+
+		/* close socket */
+		disconnect(L, m);
+	}
+	free(m->input);
+	m->input = NULL;
+	m->inputcap = 0;
+	return 0;
+}
+
+static int tostring (lua_State *L) {
+	const char   *state;
+	memcached_t  *m;
+
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	if (m->closed) {
+		state = "closed";
+	} else if (m->fd < 0) {
+		state = "disconnected";
+	} else {
+		state = "connected";
+	}
+	lua_pushfstring(L, MEMCACHED_METATABLE " [%s]: %p", state, m);
+	return 1;
+}
+
+
+/*
+ * namespace
+ */
+
+static int generation (lua_State *L, memcached_t *m, namespace_t *ns, lua_Integer delta) {
+	uint16_t  status;
+	uint64_t  now, value;
+	mkey_t    k;
+
+	/* cached? */
+	now = clockms(CLOCK_MONOTONIC);
+	if (delta == 0 && now < ns->expires) {
+		return 0;
+	}
+
+	/* fetch or advance the generation; a missing generation starts at the current time */
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	k.key = ns->name;
+	k.keylen = ns->namelen + 4;
+	k.len = k.prefixlen + k.keylen;
+	increment(L, m, PROTOCOL_BINARY_CMD_INCREMENT, &k, delta,
+			(lua_Integer)(clockms(CLOCK_REALTIME) / 1000), 0, &status, &value);
+	if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+
+	/* update cache and key prefix */
+	ns->generation = value;
+	ns->expires = now + ns->ttl;
+	ns->prefixlen = snprintf(ns->prefix, sizeof(ns->prefix), "%.*s:%" PRIu64 ":",
+			(int)ns->namelen, ns->name, value);
+	return 0;
+}
+
+static int mnamespace (lua_State *L) {
+	size_t        namelen;
+	lua_Integer   ttl;
+	const char   *name;
+	memcached_t  *m;
+	namespace_t  *ns;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	name = luaL_checklstring(L, 2, &namelen);
+	luaL_argcheck(L, namelen > 0 && namelen <= MEMCACHED_NAMESPACE_MAX, 2, "bad name length");
+	luaL_argcheck(L, !m->keycheck || validkey(name, namelen), 2, "bad name");
+	ttl = luaL_optinteger(L, 3, 1000);
+	luaL_argcheck(L, ttl >= 0 && ttl <= INT_MAX, 3, "bad TTL");
+
+	/* create namespace */
+	ns = lua_newuserdata(L, sizeof(namespace_t));
+	memset(ns, 0, sizeof(namespace_t));
+	ns->memcached_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_NAMESPACE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	ns->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	ns->ttl = (int)ttl;
+	memcpy(ns->name, name, namelen);
+	memcpy(&ns->name[namelen], ":gen", 4);
+	ns->namelen = namelen;
+
+	return 1;
+}
+
+static int invalidate (lua_State *L) {
+	memcached_t  *m;
+	namespace_t  *ns;
+
+	ns = luaL_checkudata(L, 1, MEMCACHED_NAMESPACE_METATABLE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ns->memcached_index);
+	m = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	generation(L, m, ns, 1);
+	lua_pushinteger(L, (lua_Integer)ns->generation);
+	return 1;
+}
+
+static int namespace_free (lua_State *L) {
+	namespace_t  *ns;
+
+	ns = luaL_checkudata(L, 1, MEMCACHED_NAMESPACE_METATABLE);
+	if (ns->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ns->memcached_index);
+		ns->memcached_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int namespace_tostring (lua_State *L) {
+	namespace_t  *ns;
+
+	ns = luaL_checkudata(L, 1, MEMCACHED_NAMESPACE_METATABLE);
+	lua_pushfstring(L, MEMCACHED_NAMESPACE_METATABLE " [%s]: %p",
+			lua_pushlstring(L, ns->name, ns->namelen), ns);
+	return 1;
+}
+
+
+/*
+ * counter
+ */
+
+static int flushcounters (lua_State *L, memcached_t *m) {
+	int           nret, base;
+	size_t        n, i, len;
+	uint16_t      status;
+	uint32_t      opaque;
+	uint64_t      now;
+	const char   *s;
+	lua_Integer   delta;
+	counter_t    *c;
+	op_t         *ops;
+
+	/* check state */
+	if (m->closed || m->counters_index == LUA_NOREF) {
+		return luaL_error(L, "closed");
+	}
+
+	/* collect counters with pending deltas or unknown values */
+	now = clockms(CLOCK_MONOTONIC);
+	lua_newtable(L);
+	base = lua_gettop(L);
+	n = 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->counters_index);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pop(L, 1);
+		c = lua_touserdata(L, -1);
+		if (c->key_index != LUA_NOREF && (c->pending != 0 || !c->known)) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, base, ++n);
+		}
+	}
+	lua_pop(L, 1);
+	if (n == 0) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	/* prepare requests; negative deltas decrement */
+	ops = lua_newuserdata(L, n * sizeof(op_t));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, base, i + 1);
+		c = lua_touserdata(L, -1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->key_index);
+		ops[i].k.prefix = m->prefix;
+		ops[i].k.prefixlen = m->prefixlen;
+		ops[i].k.ns = NULL;
+		ops[i].k.nslen = 0;
+		checkkey(L, m, lua_gettop(L), &ops[i].k);
+		delta = c->pending;
+		opinit(&ops[i], delta >= 0 ? PROTOCOL_BINARY_CMD_INCREMENT
+				: PROTOCOL_BINARY_CMD_DECREMENT, MEMCACHED_REQUEST_INCR_EXTRAS, 0,
+				(uint32_t)i);
+		ops[i].request.incr.message.body.delta = htobe64((uint64_t)(delta >= 0 ? delta
+				: -delta));
+		ops[i].request.incr.message.body.initial = htobe64((uint64_t)(delta >= 0 ? delta : 0));
+		ops[i].request.incr.message.body.expiration = htobe32((uint32_t)c->expiration);
+		lua_pop(L, 2);
+	}
+
+	/* send requests */
+	sendops(L, m, ops, n);
+
+	/* read responses */
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_VALUE);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			lua_pop(L, nret);
+			break;
+		}
+		if (opaque >= n) {
+			return luaL_error(L, "protocol error");
+		}
+		ops[opaque].status = status;
+		if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			s = lua_tolstring(L, -1, &len);
+			if (nret != 1 || len != sizeof(ops[opaque].number)) {
+				return luaL_error(L, "protocol error");
+			}
+			memcpy(&ops[opaque].number, s, sizeof(ops[opaque].number));
+			ops[opaque].number = be64toh(ops[opaque].number);
+		}
+		lua_pop(L, nret);
+	}
+
+	/* update counters */
+	status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, base, i + 1);
+		c = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (ops[i].status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			c->value = (lua_Integer)ops[i].number;
+			c->known = 1;
+			c->pending = 0;
+			c->flushed = now;
+		} else if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			status = ops[i].status;
+		}
+	}
+	lua_pop(L, 2);
+	if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+	return 0;
+}
+
+static int flushall (lua_State *L) {
+	return flushcounters(L, luaL_checkudata(L, 1, MEMCACHED_METATABLE));
+}
+
+static int mcounter (lua_State *L) {
+	lua_Integer   interval, threshold, expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	counter_t    *c;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	checkkey(L, m, 2, &k);
+	interval = luaL_optinteger(L, 3, 1000);
+	luaL_argcheck(L, interval >= 0 && interval <= INT_MAX, 3, "bad interval");
+	threshold = luaL_optinteger(L, 4, 0);
+	luaL_argcheck(L, threshold >= 0, 4, "bad threshold");
+	expiration = checkexpiration(L, m, 5, &ttl);
+
+	/* create counter */
+	c = lua_newuserdata(L, sizeof(counter_t));
+	memset(c, 0, sizeof(counter_t));
+	c->memcached_index = c->key_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_COUNTER_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	c->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	c->key_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	c->interval = (int)interval;
+	c->threshold = threshold;
+	c->expiration = expiration;
+	c->flushed = clockms(CLOCK_MONOTONIC);
+
+	/* register with the instance */
+	if (m->counters_index == LUA_NOREF) {
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		m->counters_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->counters_index);
+	lua_pushvalue(L, -2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+static int counter_inc (lua_State *L) {
+	lua_Integer   delta;
+	memcached_t  *m;
+	counter_t    *c;
+
+	/* check arguments */
+	c = luaL_checkudata(L, 1, MEMCACHED_COUNTER_METATABLE);
+	delta = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, delta >= 0 && delta <= LUA_MAXINTEGER - (c->pending >= 0 ? c->pending
+			: -c->pending), 2, "bad delta");
+
+	/* accumulate */
+	c->pending += lua_tointeger(L, lua_upvalueindex(1)) * delta;
+
+	/* flush if due */
+	if ((c->threshold && (c->pending >= c->threshold || -c->pending >= c->threshold))
+			|| (c->interval && clockms(CLOCK_MONOTONIC) - c->flushed >= (uint64_t)c->interval)) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->memcached_index);
+		m = lua_touserdata(L, -1);
+		flushcounters(L, m);
+	}
+	return 0;
+}
+
+static int counter_get (lua_State *L) {
+	memcached_t  *m;
+	counter_t    *c;
+
+	c = luaL_checkudata(L, 1, MEMCACHED_COUNTER_METATABLE);
+	if (!c->known) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->memcached_index);
+		m = lua_touserdata(L, -1);
+		flushcounters(L, m);
+	}
+	lua_pushinteger(L, c->value + (lua_toboolean(L, 2) ? c->pending : 0));
+	return 1;
+}
+
+static int counter_flush (lua_State *L) {
+	memcached_t  *m;
+	counter_t    *c;
+
+	c = luaL_checkudata(L, 1, MEMCACHED_COUNTER_METATABLE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->memcached_index);
+	m = lua_touserdata(L, -1);
+	flushcounters(L, m);
+	lua_pushinteger(L, c->value);
+	return 1;
+}
+
+static int counter_free (lua_State *L) {
+	memcached_t  *m;
+	counter_t    *c;
+
+	c = luaL_checkudata(L, 1, MEMCACHED_COUNTER_METATABLE);
+	if (c->pending != 0 && c->memcached_index != LUA_NOREF) {
+		/* flush pending delta, unless closed */
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->memcached_index);
+		m = lua_touserdata(L, -1);
+		if (!m->closed && m->counters_index != LUA_NOREF) {
+			lua_pushcfunction(L, flushall);
+			lua_insert(L, -2);
+			if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+				/* ignore error, if any */
+				lua_pop(L, 1);
+			}
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	if (c->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->memcached_index);
+		c->memcached_index = LUA_NOREF;
+	}
+	if (c->key_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->key_index);
+		c->key_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int counter_tostring (lua_State *L) {
+	counter_t  *c;
+
+	c = luaL_checkudata(L, 1, MEMCACHED_COUNTER_METATABLE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->key_index);
+	lua_pushfstring(L, MEMCACHED_COUNTER_METATABLE " [%s]: %p", lua_tostring(L, -1), c);
+	return 1;
+}
+
+
+/*
+ * sharded counter
+ */
+
+static int mshardedcounter (lua_State *L) {
+	int                i;
+	lua_Integer        n, expiration, ttl;
+	mkey_t             k;
+	memcached_t       *m;
+	shardedcounter_t  *sc;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	luaL_checkstring(L, 2);
+	n = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, n > 0 && n <= 1024, 3, "bad number of shards");
+	expiration = checkexpiration(L, m, 4, &ttl);
+
+	/* create sharded counter */
+	sc = lua_newuserdata(L, sizeof(shardedcounter_t));
+	memset(sc, 0, sizeof(shardedcounter_t));
+	sc->memcached_index = sc->keys_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	sc->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	sc->n = (int)n;
+	sc->expiration = expiration;
+
+	/* prepare shard keys, 'key:1' to 'key:n', once */
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	lua_createtable(L, sc->n, 0);
+	for (i = 1; i <= sc->n; i++) {
+		lua_pushvalue(L, 2);
+		lua_pushfstring(L, ":%d", i);
+		lua_concat(L, 2);
+		checkkey(L, m, lua_gettop(L), &k);
+		lua_rawseti(L, -2, i);
+	}
+	sc->keys_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return 1;
+}
+
+static int shardedcounter_inc (lua_State *L) {
+	int                shard;
+	uint16_t           status;
+	uint64_t           value;
+	lua_Integer        delta;
+	mkey_t             k;
+	memcached_t       *m;
+	shardedcounter_t  *sc;
+
+	/* check arguments */
+	sc = luaL_checkudata(L, 1, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	delta = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, delta >= 0, 2, "bad delta");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, sc->memcached_index);
+	m = lua_touserdata(L, -1);
+
+	/* increment a random shard */
+	shard = 1 + (int)((1.0 - random01(m)) * sc->n);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, sc->keys_index);
+	lua_rawgeti(L, -1, shard);
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	checkkey(L, m, lua_gettop(L), &k);
+	increment(L, m, PROTOCOL_BINARY_CMD_INCREMENT, &k, delta, delta, sc->expiration, &status,
+			&value);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		return 0;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int shardedcounter_get (lua_State *L) {
+	int                i, nret;
+	size_t             len;
+	uint16_t           status, rstatus;
+	uint32_t           opaque;
+	uint64_t           sum, value;
+	const char        *s;
+	memcached_t       *m;
+	shardedcounter_t  *sc;
+	op_t              *ops;
+
+	/* check arguments */
+	sc = luaL_checkudata(L, 1, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, sc->memcached_index);
+	m = lua_touserdata(L, -1);
+
+	/* prepare requests; quiet gets skip missing shards */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, sc->keys_index);
+	ops = lua_newuserdata(L, sc->n * sizeof(op_t));
+	for (i = 0; i < sc->n; i++) {
+		lua_rawgeti(L, -2, i + 1);
+		ops[i].k.prefix = m->prefix;
+		ops[i].k.prefixlen = m->prefixlen;
+		ops[i].k.ns = NULL;
+		ops[i].k.nslen = 0;
+		checkkey(L, m, lua_gettop(L), &ops[i].k);
+		opinit(&ops[i], PROTOCOL_BINARY_CMD_GETQ, MEMCACHED_REQUEST_GET_EXTRAS, 0, (uint32_t)i);
+		lua_pop(L, 1);
+	}
+
+	/* send requests */
+	sendops(L, m, ops, sc->n);
+
+	/* read responses, and sum; incremented values are decimal, possibly padded with spaces */
+	sum = 0;
+	status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	while (1) {
+		nret = recvresponse(L, m, &rstatus, NULL, &opaque, MEMCACHED_VALUE);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			lua_pop(L, nret);
+			break;
+		}
+		if (rstatus == PROTOCOL_BINARY_RESPONSE_SUCCESS && nret == 1) {
+			s = lua_tolstring(L, -1, &len);
+			value = 0;
+			while (len > 0 && *s >= '0' && *s <= '9') {
+				value = value * 10 + (*s++ - '0');
+				len--;
+			}
+			sum += value;
+		} else if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			status = rstatus;
+		}
+		lua_pop(L, nret);
+	}
+	if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+	lua_pushinteger(L, (lua_Integer)sum);
+	return 1;
+}
+
+static int shardedcounter_free (lua_State *L) {
+	shardedcounter_t  *sc;
+
+	sc = luaL_checkudata(L, 1, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	if (sc->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, sc->memcached_index);
+		sc->memcached_index = LUA_NOREF;
+	}
+	if (sc->keys_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, sc->keys_index);
+		sc->keys_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int shardedcounter_tostring (lua_State *L) {
+	shardedcounter_t  *sc;
+
+	sc = luaL_checkudata(L, 1, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	lua_pushfstring(L, MEMCACHED_SHARDEDCOUNTER_METATABLE " [%d]: %p", sc->n, sc);
+	return 1;
+}
+
+
+/*
+ * lock
+ */
+
+static int acquire (lua_State *L, memcached_t *m, mkey_t *k, lua_Integer expiration,
+		uint64_t *cas, uint16_t *status) {
+	struct iovec                 iov[1 + MEMCACHED_KEY_IOVCNT];
+	protocol_binary_request_set  request;
+
+	/* prepare request; the lock item has an empty value */
+	memset(&request, 0, sizeof(request));
+	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_ADD;
+	request.message.header.request.extlen = MEMCACHED_REQUEST_SET_EXTRAS;
+	request.message.header.request.keylen = htobe16((uint16_t)k->len);
+	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_SET_EXTRAS
+			+ k->len));
+	request.message.body.expiration = htobe32((uint32_t)expiration);
+
+	/* send request */
+	getsocket(L, m);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request.bytes);
+	sendmsgnosig(L, m, iov, 1 + keyiov(k, &iov[1]), 0);
+
+	/* read response */
+	*cas = 0;
+	lua_pop(L, recvresponse(L, m, status, cas, NULL, 0));
+	return 0;
+}
+
+static int mlock (lua_State *L) {
+	int               backoff_ms, sleep_ms;
+	uint16_t          status;
+	uint64_t          cas, deadline, now;
+	lua_Integer       expiration, ttl, wait;
+	struct timespec   ts;
+	mkey_t            k;
+	memcached_t      *m;
+	lock_t           *l;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	checkkey(L, m, 2, &k);
+	ttl = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, ttl > 0 && ttl <= MEMCACHED_TTL_MAX, 3, "bad TTL");
+	expiration = ttl;
+	wait = luaL_optinteger(L, 4, 0);
+	luaL_argcheck(L, wait >= 0 && wait <= INT_MAX, 4, "bad wait");
+
+	/* acquire, backing off with jitter while the lock is held by another owner */
+	deadline = clockms(CLOCK_MONOTONIC) + (uint64_t)wait;
+	backoff_ms = 0;
+	while (1) {
+		acquire(L, m, &k, expiration, &cas, &status);
+		if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			break;
+		}
+		if (status != PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS
+				&& status != PROTOCOL_BINARY_RESPONSE_NOT_STORED) {
+			return luaL_error(L, "memcached error (%d)", (int)status);
+		}
+		now = clockms(CLOCK_MONOTONIC);
+		if (now >= deadline) {
+			lua_pushnil(L);
+			return 1;
+		}
+		if (backoff_ms == 0) {
+			backoff(L, 5, 25, &backoff_ms);
+		} else if (backoff_ms < 1000) {
+			backoff_ms *= 2;
+		}
+		sleep_ms = (int)(backoff_ms * random01(m));
+		if ((uint64_t)sleep_ms > deadline - now) {
+			sleep_ms = (int)(deadline - now);
+		}
+		ts.tv_sec = sleep_ms / 1000;
+		ts.tv_nsec = (sleep_ms % 1000) * 1000000;
+		(void)nanosleep(&ts, NULL);
+	}
+
+	/* create lock */
+	l = lua_newuserdata(L, sizeof(lock_t));
+	memset(l, 0, sizeof(lock_t));
+	l->memcached_index = l->key_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_LOCK_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	l->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	l->key_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	l->cas = cas;
+	l->held = 1;
+	lua_pushinteger(L, (lua_Integer)cas);
+	return 2;
+}
+
+static int lock_token (lua_State *L) {
+	lock_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LOCK_METATABLE);
+	lua_pushinteger(L, (lua_Integer)l->cas);
+	return 1;
+}
+
+static int lock_release (lua_State *L) {
+	uint16_t      status;
+	uint64_t      cas;
+	mkey_t        k;
+	memcached_t  *m;
+	lock_t       *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LOCK_METATABLE);
+	if (!l->held) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->memcached_index);
+	m = lua_touserdata(L, -1);
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->key_index);
+	checkkey(L, m, lua_gettop(L), &k);
+
+	/* delete only if the lock item is unchanged, i.e., still owned */
+	l->held = 0;
+	lua_pushnil(L);
+	cas = l->cas;
+	store(L, m, PROTOCOL_BINARY_CMD_DELETE, &k, lua_gettop(L), 0, 0, 0, &cas, &status);
+	switch (status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		lua_pushboolean(L, 1);
+		return 1;
+
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:  /* lost */
+		lua_pushboolean(L, 0);
+		return 1;
+
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)status);
+	}
+}
+
+static int lock_free (lua_State *L) {
+	lock_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LOCK_METATABLE);
+	if (l->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->memcached_index);
+		l->memcached_index = LUA_NOREF;
+	}
+	if (l->key_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->key_index);
+		l->key_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int lock_tostring (lua_State *L) {
+	lock_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LOCK_METATABLE);
+	lua_pushfstring(L, MEMCACHED_LOCK_METATABLE ": %p", l);
+	return 1;
+}
+
+
+/*
+ * list
+ */
+
+static memcached_t *listkey (lua_State *L, list_t *l, int index, mkey_t *k) {
+	memcached_t  *m;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->memcached_index);
+	m = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	k->prefix = m->prefix;
+	k->prefixlen = m->prefixlen;
+	k->ns = NULL;
+	k->nslen = 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, index);
+	checkkey(L, m, lua_gettop(L), k);
+	return m;
+}
+
+static int setlistsize (lua_State *L, list_t *l, size_t size) {
+	int           nret;
+	char          value[24];
+	size_t        len;
+	uint16_t      status;
+	uint32_t      opaque;
+	memcached_t  *m;
+	op_t          op;
+
+	/* set the size counter, as a decimal string to support increments */
+	m = listkey(L, l, l->sizekey_index, &op.k);
+	len = (size_t)snprintf(value, sizeof(value), "%zu", size);
+	opinit(&op, PROTOCOL_BINARY_CMD_SET, MEMCACHED_REQUEST_SET_EXTRAS, len, 0);
+	op.request.set.message.body.expiration = htobe32((uint32_t)l->expiration);
+	op.value = value;
+	op.valuelen = len;
+	sendops(L, m, &op, 1);
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, 0);
+		lua_pop(L, nret);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			break;
+		}
+		op.status = status;
+	}
+	lua_pop(L, 1);  /* key */
+	if (op.status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)op.status);
+	}
+	return 0;
+}
+
+static int compact (lua_State *L, list_t *l) {
+	int                  refresh, nret;
+	char                *value;
+	size_t               len, valuelen;
+	uint16_t             status;
+	uint32_t             opaque;
+	uint64_t             cas;
+	const char          *s;
+	lua_Integer          n, i, first;
+	mkey_t               k;
+	memcached_t         *m;
+	memcached_buffer_t  *b;
+	op_t                 op;
+
+	/* read */
+	m = listkey(L, l, l->key_index, &k);
+	if (!fetch(L, m, &k, -1, &cas, &refresh)) {
+		setlistsize(L, l, 0);
+		return 0;
+	}
+	luaL_checktype(L, -1, LUA_TTABLE);
+
+	/* trim, keeping the newest records within the limit and half the threshold */
+	n = (lua_Integer)lua_rawlen(L, -1);
+	lua_createtable(L, n <= INT_MAX ? (int)n : INT_MAX, 0);
+	valuelen = 0;
+	first = n + 1;
+	for (i = n; i > 0 && (l->limit == 0 || n - i < l->limit); i--) {
+		lua_rawgeti(L, -2, i);
+		encodevalue(L, m, lua_gettop(L), 1, &s, &len);
+		if (i < n && valuelen + len > l->threshold / 2) {
+			lua_pop(L, 2);
+			break;
+		}
+		valuelen += len;
+		lua_rawseti(L, -3, i);
+		lua_pop(L, 1);
+		first = i;
+	}
+	if (first == 1) {
+		setlistsize(L, l, valuelen);
+		return 0;  /* nothing to trim */
+	}
+
+	/* concatenate the kept records */
+	value = lua_newuserdata(L, valuelen + 1);
+	len = 0;
+	for (i = first; i <= n; i++) {
+		lua_rawgeti(L, -2, i);
 		b = luaL_testudata(L, -1, MEMCACHED_BUFFER_METATABLE);
 		if (b) {
-			value = b->b;
-			valuelen = b->pos;
-		} else if (lua_isstring(L, -1)) {
-			value = lua_tolstring(L, -1, &valuelen);
+			memcpy(&value[len], b->b, b->pos);
+			len += b->pos;
 		} else {
-			return luaL_error(L, "encoder must return buffer or string");
+			s = lua_tolstring(L, -1, &valuelen);
+			memcpy(&value[len], s, valuelen);
+			len += valuelen;
 		}
-		if (valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + keylen)) {
-			return luaL_error(L, "encoded value too long");
+		lua_pop(L, 1);
+	}
+
+	/* set, unless modified concurrently */
+	op.k = k;
+	if (k.key == k.buf) {
+		op.k.key = op.k.buf;  /* hashed key */
+	}
+	opinit(&op, PROTOCOL_BINARY_CMD_SET, MEMCACHED_REQUEST_SET_EXTRAS, len, 0);
+	op.request.header.request.cas = htobe64(cas);
+	op.request.set.message.body.expiration = htobe32((uint32_t)l->expiration);
+	op.value = value;
+	op.valuelen = len;
+	sendops(L, m, &op, 1);
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, 0);
+		lua_pop(L, nret);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			break;
 		}
+		op.status = status;
+	}
+	switch (op.status) {
+	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+		setlistsize(L, l, len);
+		return 0;
 
-		/* prepare request */
-		memset(&srequest, 0, sizeof(srequest));
-		srequest.message.header.request.magic = PROTOCOL_BINARY_REQ;
-		srequest.message.header.request.opcode = (uint8_t)lua_tointeger(L, lua_upvalueindex(1));
-		srequest.message.header.request.extlen = MEMCACHED_REQUEST_SET_EXTRAS;
-		srequest.message.header.request.keylen = htobe16((uint16_t)keylen);
-		srequest.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_SET_EXTRAS
-				+ keylen + valuelen));
-		srequest.message.header.request.cas = htobe64(cas);
-		srequest.message.body.expiration = htobe32((uint32_t)expiration);
+	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:  /* modified concurrently; compact later */
+		return 0;
 
-		/* send request */
-		getsocket(L, m);
-		iov[0].iov_base = &srequest;
-		iov[0].iov_len = sizeof(srequest.bytes);
-		iov[1].iov_base = (void *)key;
-		iov[1].iov_len = (uint16_t)keylen;
-		iov[2].iov_base = (void *)value;
-		iov[2].iov_len = valuelen;
-		sendmsgnosig(L, m, iov, 3);
-	} else {
-		/* prepare request */
-		memset(&drequest, 0, sizeof(drequest));
-		drequest.message.header.request.magic = PROTOCOL_BINARY_REQ;
-		drequest.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETE;
-		drequest.message.header.request.extlen = MEMCACHED_REQUEST_DELETE_EXTRAS;
-		drequest.message.header.request.keylen = htobe16(keylen);
-		drequest.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_DELETE_EXTRAS
-				+ keylen));
-		drequest.message.header.request.cas = htobe64(cas);
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)op.status);
+	}
+}
 
-		/* send request */
-		getsocket(L, m);
-		iov[0].iov_base = &drequest;
-		iov[0].iov_len = sizeof(drequest.bytes);
-		iov[1].iov_base = (void *)key;
-		iov[1].iov_len = (uint16_t)keylen;
-		sendmsgnosig(L, m, iov, 2);
+static int mlist (lua_State *L) {
+	lua_Integer   limit, threshold, expiration, ttl;
+	mkey_t        k;
+	memcached_t  *m;
+	list_t       *l;
+
+	/* check arguments */
+	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
+	k.prefix = m->prefix;
+	k.prefixlen = m->prefixlen;
+	k.ns = NULL;
+	k.nslen = 0;
+	checkkey(L, m, 2, &k);
+	limit = luaL_optinteger(L, 3, 100);
+	luaL_argcheck(L, limit >= 0, 3, "bad limit");
+	threshold = luaL_optinteger(L, 4, 65536);
+	luaL_argcheck(L, threshold > 0 && threshold <= UINT32_MAX, 4, "bad threshold");
+	expiration = checkexpiration(L, m, 5, &ttl);
+
+	/* create list */
+	l = lua_newuserdata(L, sizeof(list_t));
+	memset(l, 0, sizeof(list_t));
+	l->memcached_index = l->key_index = l->sizekey_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_LIST_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	l->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	l->key_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	lua_pushliteral(L, ":size");
+	lua_concat(L, 2);
+	checkkey(L, m, lua_gettop(L), &k);
+	l->sizekey_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	l->limit = limit;
+	l->threshold = (size_t)threshold;
+	l->expiration = expiration;
+	return 1;
+}
+
+static int list_push (lua_State *L) {
+	int           stored, nret;
+	size_t        len;
+	uint16_t      status;
+	uint32_t      opaque;
+	uint64_t      size;
+	const char   *s, *value;
+	op_t         *ops;
+	list_t       *l;
+	memcached_t  *m;
+
+	/* check arguments */
+	l = luaL_checkudata(L, 1, MEMCACHED_LIST_METATABLE);
+	luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "value required");
+	lua_settop(L, 2);
+
+	/* prepare requests; the size is counted on the server, as handles may be short-lived */
+	ops = lua_newuserdata(L, 2 * sizeof(op_t));
+	m = listkey(L, l, l->key_index, &ops[0].k);
+	listkey(L, l, l->sizekey_index, &ops[1].k);
+	encodevalue(L, m, 2, 1, &value, &len);
+	if (len > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + ops[0].k.len)) {
+		return luaL_error(L, "encoded value too long");
+	}
+	opinit(&ops[0], PROTOCOL_BINARY_CMD_APPENDQ, 0, len, 0);
+	ops[0].value = value;
+	ops[0].valuelen = len;
+	opinit(&ops[1], PROTOCOL_BINARY_CMD_INCREMENT, MEMCACHED_REQUEST_INCR_EXTRAS, 0, 1);
+	ops[1].request.incr.message.body.delta = htobe64((uint64_t)len);
+	ops[1].request.incr.message.body.initial = htobe64((uint64_t)len);
+	ops[1].request.incr.message.body.expiration = htobe32((uint32_t)l->expiration);
+
+	/* append and count; the quiet append only responds on failure */
+	sendops(L, m, ops, 2);
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_VALUE);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			lua_pop(L, nret);
+			break;
+		}
+		if (opaque > 1) {
+			return luaL_error(L, "protocol error");
+		}
+		ops[opaque].status = status;
+		if (opaque == 1 && status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+			s = lua_tolstring(L, -1, &len);
+			if (nret != 1 || len != sizeof(ops[1].number)) {
+				return luaL_error(L, "protocol error");
+			}
+			memcpy(&ops[1].number, s, sizeof(ops[1].number));
+			ops[1].number = be64toh(ops[1].number);
+		}
+		lua_pop(L, nret);
 	}
+	switch (ops[0].status) {
+	case MEMCACHED_STATUS_NONE:
+		stored = 1;
+		break;
 
-	/* read response */
-	recvresponse(L, m, &status, &cas, 0);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		lua_pushboolean(L, 1);
-		lua_pushinteger(L, cas);
-		return 2;
+	case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* missing key */
+		stored = concat(L, m, &ops[0], 1, PROTOCOL_BINARY_CMD_APPENDQ, l->expiration) == 0;
+		break;
 
-	case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
-	case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
-		lua_pushboolean(L, 0);
+	default:
+		return luaL_error(L, "memcached error (%d)", (int)ops[0].status);
+	}
+	size = ops[1].status == PROTOCOL_BINARY_RESPONSE_SUCCESS ? ops[1].number : 0;
+
+	/* compact as needed */
+	if (stored && size >= l->threshold) {
+		compact(L, l);
+	}
+	lua_pushboolean(L, stored);
+	return 1;
+}
+
+static int list_range (lua_State *L) {
+	int           refresh;
+	uint64_t      cas;
+	lua_Integer   n, i, j, p;
+	mkey_t        k;
+	memcached_t  *m;
+	list_t       *l;
+
+	/* check arguments; negative positions count from the end */
+	l = luaL_checkudata(L, 1, MEMCACHED_LIST_METATABLE);
+	i = luaL_optinteger(L, 2, 1);
+	j = luaL_optinteger(L, 3, -1);
+	lua_settop(L, 3);
+
+	/* read */
+	m = listkey(L, l, l->key_index, &k);
+	if (!fetch(L, m, &k, -1, &cas, &refresh)) {
+		lua_newtable(L);
 		return 1;
+	}
+	luaL_checktype(L, -1, LUA_TTABLE);
+	n = (lua_Integer)lua_rawlen(L, -1);
+	if (i < 0) {
+		i = i < -n ? 1 : n + i + 1;
+	} else if (i == 0) {
+		i = 1;
+	}
+	if (j < 0) {
+		j = n + j + 1;
+	} else if (j > n) {
+		j = n;
+	}
+	if (i == 1 && j == n) {
+		return 1;
+	}
 
-	default:
-		return luaL_error(L, "memcached error (%d)", (int)status);
+	/* slice */
+	lua_createtable(L, j >= i && j - i < INT_MAX ? (int)(j - i + 1) : 0, 0);
+	for (p = i; p <= j; p++) {
+		lua_rawgeti(L, -2, p);
+		lua_rawseti(L, -2, p - i + 1);
+	}
+	return 1;
+}
+
+static int list_compact (lua_State *L) {
+	list_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LIST_METATABLE);
+	compact(L, l);
+	return 0;
+}
+
+static int list_free (lua_State *L) {
+	list_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LIST_METATABLE);
+	if (l->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->memcached_index);
+		l->memcached_index = LUA_NOREF;
 	}
+	if (l->key_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->key_index);
+		l->key_index = LUA_NOREF;
+	}
+	if (l->sizekey_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->sizekey_index);
+		l->sizekey_index = LUA_NOREF;
+	}
+	return 0;
 }
 
-static int incr (lua_State *L) {
-	int                           nret, attempts, backoff_ms;
-	size_t                        keylen, len;
-	uint16_t                      status;
-	uint64_t                      value;
-	const char                   *key;
-	lua_Integer                   delta, initial, expiration;
-	memcached_t                  *m;
-	struct iovec                  iov[2];
-	struct timespec               ts;
-	protocol_binary_request_incr  request;
+static int list_tostring (lua_State *L) {
+	list_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LIST_METATABLE);
+	lua_pushfstring(L, MEMCACHED_LIST_METATABLE ": %p", l);
+	return 1;
+}
+
+
+/*
+ * batch
+ */
+
+static int mbatch (lua_State *L) {
+	int                  nret, errindex;
+	size_t               n, i, len, first, count;
+	uint8_t              opcode;
+	uint16_t             status, error;
+	uint32_t             opaque;
+	const char          *s;
+	lua_Integer          expiration;
+	mkey_t               k;
+	memcached_buffer_t  *vb;
+	memcached_t         *m;
+	batch_t             *b;
+	op_t                *ops;
+	optimer_t            t;
 
 	/* check arguments */
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	key = luaL_checklstring(L, 2, &keylen);
-	luaL_argcheck(L, keylen > 0 && keylen <= UINT16_MAX, 2, "bad key length");
-	delta = luaL_optinteger(L, 3, 1);
-	luaL_argcheck(L, delta >= 0 && delta <= INT64_MAX, 3, "bad delta");
-	initial = luaL_optinteger(L, 4, 1);
-	luaL_argcheck(L, initial >= 0 && initial <= INT64_MAX, 4, "bad initial value");
-	expiration = luaL_optinteger(L, 5, 0);
-	luaL_argcheck(L, expiration >= 0 && expiration <= UINT32_MAX, 5, "bad expiration");
+	m = checkmemcached(L, 1, &k);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	/* create batch; the instance or namespace at index 1 anchors the base key */
+	b = lua_newuserdata(L, sizeof(batch_t));
+	memset(b, 0, sizeof(batch_t));
+	b->ops_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_BATCH_METATABLE);
+	lua_setmetatable(L, -2);
+	b->m = m;
+	b->k = k;
+	lua_newtable(L);
+	b->ops_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* queue operations; the batch is done even if the function fails */
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		b->done = 1;
+		return lua_error(L);
+	}
+	b->done = 1;
+	n = b->n;
+	lua_settop(L, 3);
+	lua_createtable(L, n <= INT_MAX ? (int)n : INT_MAX, 0);
+	if (n == 0) {
+		return 1;
+	}
 
-	/* prepare request */
-	memset(&request, 0, sizeof(request));
-	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-	request.message.header.request.opcode = (uint8_t)lua_tointeger(L, lua_upvalueindex(1));
-	request.message.header.request.extlen = MEMCACHED_REQUEST_INCR_EXTRAS;
-	request.message.header.request.keylen = htobe16((uint16_t)keylen);
-	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_INCR_EXTRAS
-			+ keylen));
-	request.message.body.delta = htobe64((uint64_t)delta);
-	request.message.body.initial = htobe64((uint64_t)initial);
-	request.message.body.expiration = htobe32((uint32_t)expiration);
+	/* prepare requests; the operations table anchors the keys and encoded values */
+	opstart(m, &t);
+	ops = lua_newuserdata(L, n * sizeof(op_t));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, b->ops_index);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, -1, (lua_Integer)i + 1);
+		lua_rawgeti(L, -1, 1);
+		opcode = (uint8_t)lua_tointeger(L, -1);
+		lua_rawgeti(L, -2, 2);
+		ops[i].k = b->k;
+		checkkey(L, m, lua_gettop(L), &ops[i].k);
+		lua_rawgeti(L, -3, 4);
+		expiration = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+		switch (opcode) {
+		case PROTOCOL_BINARY_CMD_GET:
+			opinit(&ops[i], opcode, MEMCACHED_REQUEST_GET_EXTRAS, 0, (uint32_t)i);
+			break;
 
-	/* prepare sending */
-	attempts = 3;
-	backoff_ms = 0;
-	getsocket(L, m);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *)key;
-	iov[1].iov_len = (uint16_t)keylen;
+		case PROTOCOL_BINARY_CMD_SET:
+		case PROTOCOL_BINARY_CMD_ADD:
+		case PROTOCOL_BINARY_CMD_REPLACE:
+			lua_rawgeti(L, -1, 3);
+			vb = luaL_testudata(L, -1, MEMCACHED_BUFFER_METATABLE);
+			if (vb) {
+				s = vb->b;
+				len = vb->pos;
+			} else {
+				s = lua_tolstring(L, -1, &len);
+			}
+			lua_pop(L, 1);
+			opinit(&ops[i], opcode, MEMCACHED_REQUEST_SET_EXTRAS, len, (uint32_t)i);
+			ops[i].request.set.message.body.expiration = htobe32((uint32_t)expiration);
+			ops[i].value = s;
+			ops[i].valuelen = len;
+			break;
 
-	/* send request */
-	redo:
-	sendmsgnosig(L, m, iov, 2);
+		case PROTOCOL_BINARY_CMD_DELETE:
+			opinit(&ops[i], opcode, MEMCACHED_REQUEST_DELETE_EXTRAS, 0, (uint32_t)i);
+			break;
 
-	/* read response */
-	nret = recvresponse(L, m, &status, NULL, MEMCACHED_VALUE);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		if (nret != 1) {
+		case PROTOCOL_BINARY_CMD_INCREMENT:
+		case PROTOCOL_BINARY_CMD_DECREMENT:
+			opinit(&ops[i], opcode, MEMCACHED_REQUEST_INCR_EXTRAS, 0, (uint32_t)i);
+			lua_rawgeti(L, -1, 5);
+			ops[i].request.incr.message.body.delta = htobe64((uint64_t)lua_tointeger(L, -1));
+			lua_rawgeti(L, -2, 6);
+			ops[i].request.incr.message.body.initial = htobe64((uint64_t)lua_tointeger(L, -1));
+			lua_pop(L, 2);
+			ops[i].request.incr.message.body.expiration = htobe32((uint32_t)expiration);
+			break;
+
+		default:  /* touch */
+			opinit(&ops[i], opcode, MEMCACHED_REQUEST_TOUCH_EXTRAS, 0, (uint32_t)i);
+			ops[i].request.touch.message.body.expiration = htobe32((uint32_t)expiration);
+		}
+		lua_pop(L, 1);
+	}
+
+	/* send requests in chunks, each drained before the next, which bounds the responses in
+	 * flight; errors are raised once the pipeline is drained */
+	error = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	lua_pushnil(L);
+	errindex = lua_gettop(L);
+	for (first = 0; first < n; first += count) {
+		count = n - first < MEMCACHED_BATCH_CHUNK ? n - first : MEMCACHED_BATCH_CHUNK;
+		sendops(L, m, &ops[first], count);
+
+		/* read responses, matched by opaque */
+		while (1) {
+			nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_EXTRAS | MEMCACHED_VALUE
+					| MEMCACHED_VALUE_BUFFER);
+			if (opaque == MEMCACHED_OPAQUE_NOOP) {
+				lua_pop(L, nret);
+				break;
+			}
+			if (opaque < first || opaque >= first + count) {
+				return protocolerror(L, m);
+			}
+			ops[opaque].status = status;
+			opcode = ops[opaque].request.header.request.opcode;
+			if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+				lua_pop(L, nret);
+				if (opcode == PROTOCOL_BINARY_CMD_GET
+						&& status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+					tally(m, MEMCACHED_TALLY_MISSES, 1);
+				}
+				switch (status) {
+				case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+				case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS:
+				case PROTOCOL_BINARY_RESPONSE_NOT_STORED:
+				case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL:
+					break;
+
+				default:
+					if (error == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+						error = status;
+					}
+				}
+				lua_pushboolean(L, 0);
+			} else if (opcode == PROTOCOL_BINARY_CMD_GET) {
+				if (!decodeitem(L, m, nret)) {
+					if (lua_isnil(L, errindex)) {
+						lua_replace(L, errindex);
+					} else {
+						lua_pop(L, 1);
+					}
+					lua_pushboolean(L, 0);
+				}
+			} else if (opcode == PROTOCOL_BINARY_CMD_INCREMENT
+					|| opcode == PROTOCOL_BINARY_CMD_DECREMENT) {
+				/* the value is a buffer, as requested for gets */
+				vb = nret == 1 ? luaL_testudata(L, -1, MEMCACHED_BUFFER_METATABLE) : NULL;
+				if (!vb || vb->len != sizeof(ops[opaque].number)) {
+					return protocolerror(L, m);
+				}
+				memcpy(&ops[opaque].number, vb->b, sizeof(ops[opaque].number));
+				lua_pop(L, 1);
+				lua_pushinteger(L, (lua_Integer)be64toh(ops[opaque].number));
+			} else {
+				lua_pop(L, nret);
+				lua_pushboolean(L, 1);
+			}
+			lua_rawseti(L, 4, (lua_Integer)opaque + 1);
+		}
+	}
+	if (!lua_isnil(L, errindex)) {
+		lua_pushvalue(L, errindex);
+		return lua_error(L);
+	}
+	if (error != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)error);
+	}
+
+	/* operations without a response, if any, failed */
+	for (i = 0; i < n; i++) {
+		if (ops[i].status == MEMCACHED_STATUS_NONE) {
 			return luaL_error(L, "protocol error");
 		}
-		const char *s = lua_tolstring(L, -1, &len);
-		if (len != sizeof(value)) {
-				return luaL_error(L, "protocol error");
+	}
+	opend(L, m, MEMCACHED_METRIC_MULTI, NULL, &t);
+	lua_settop(L, 4);
+	return 1;
+}
+
+static int batch_op (lua_State *L) {
+	uint8_t       opcode;
+	lua_Integer   expiration, ttl, delta, initial;
+	const char   *value;
+	size_t        valuelen;
+	mkey_t        k;
+	batch_t      *b;
+
+	/* check arguments */
+	b = luaL_checkudata(L, 1, MEMCACHED_BATCH_METATABLE);
+	if (b->done) {
+		return luaL_error(L, "batch done");
+	}
+	k = b->k;
+	checkkey(L, b->m, 2, &k);
+	luaL_argcheck(L, b->n < MEMCACHED_OPAQUE_ASYNC - 1, 1, "too many operations");
+	opcode = (uint8_t)lua_tointeger(L, lua_upvalueindex(1));
+	delta = initial = 0;
+	expiration = 0;
+	switch (opcode) {
+	case PROTOCOL_BINARY_CMD_GET:
+		break;
+
+	case PROTOCOL_BINARY_CMD_SET:
+	case PROTOCOL_BINARY_CMD_ADD:
+	case PROTOCOL_BINARY_CMD_REPLACE:
+		if (opcode == PROTOCOL_BINARY_CMD_SET) {
+			luaL_checkany(L, 3);
+			if (lua_isnil(L, 3)) {
+				opcode = PROTOCOL_BINARY_CMD_DELETE;
+			}
+		} else {
+			luaL_argcheck(L, !lua_isnoneornil(L, 3), 3, "value required");
 		}
-		memcpy(&value, s, sizeof(value));
-		lua_pushinteger(L, be64toh(value));
-		return 1;
+		expiration = checkexpiration(L, b->m, 4, &ttl);
+		break;
 
-	case PROTOCOL_BINARY_RESPONSE_NOT_STORED:  /* race condition */
-		if (--attempts == 0) {
-			return luaL_error(L, "memcached error (%d)", (int)status);
+	case PROTOCOL_BINARY_CMD_INCREMENT:
+	case PROTOCOL_BINARY_CMD_DECREMENT:
+		delta = luaL_optinteger(L, 3, 1);
+		luaL_argcheck(L, delta >= 0 && delta <= INT64_MAX, 3, "bad delta");
+		initial = luaL_optinteger(L, 4, 1);
+		luaL_argcheck(L, initial >= 0 && initial <= INT64_MAX, 4, "bad initial value");
+		expiration = checkexpiration(L, b->m, 5, &ttl);
+		break;
+
+	default:  /* touch */
+		expiration = checkexpiration(L, b->m, 3, &ttl);
+	}
+	lua_settop(L, 3);
+
+	/* queue operation */
+	lua_createtable(L, 6, 0);
+	lua_pushinteger(L, opcode);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 2);
+	if (opcode == PROTOCOL_BINARY_CMD_SET || opcode == PROTOCOL_BINARY_CMD_ADD
+			|| opcode == PROTOCOL_BINARY_CMD_REPLACE) {
+		encodevalue(L, b->m, 3, 0, &value, &valuelen);
+		if (valuelen > UINT32_MAX - (MEMCACHED_REQUEST_SET_EXTRAS + k.len)) {
+			return luaL_error(L, "encoded value too long");
 		}
-		if (backoff_ms == 0) {
-			backoff(L, 5, 25, &backoff_ms);
+		lua_rawseti(L, -2, 3);
+	}
+	lua_pushinteger(L, expiration);
+	lua_rawseti(L, -2, 4);
+	lua_pushinteger(L, delta);
+	lua_rawseti(L, -2, 5);
+	lua_pushinteger(L, initial);
+	lua_rawseti(L, -2, 6);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, b->ops_index);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, (lua_Integer)++b->n);
+	return 0;
+}
+
+static int batch_free (lua_State *L) {
+	batch_t  *b;
+
+	b = luaL_checkudata(L, 1, MEMCACHED_BATCH_METATABLE);
+	b->done = 1;
+	if (b->ops_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, b->ops_index);
+		b->ops_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int batch_tostring (lua_State *L) {
+	batch_t  *b;
+
+	b = luaL_checkudata(L, 1, MEMCACHED_BATCH_METATABLE);
+	lua_pushfstring(L, MEMCACHED_BATCH_METATABLE ": %p", b);
+	return 1;
+}
+
+
+/*
+ * loader
+ */
+
+static int dispatch (lua_State *L, loader_t *l) {
+	int           nret, top;
+	uint16_t      error;
+	size_t        n, i, j, hits;
+	uint16_t      status;
+	uint32_t      opaque;
+	mkey_t        k;
+	memcached_t  *m;
+	op_t         *ops;
+	optimer_t     t;
+
+	/* take the pending requests; further requests start a new batch */
+	top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->memcached_index);
+	m = checkmemcached(L, top + 1, &k);
+	n = l->n;
+	if (n == 0) {
+		lua_settop(L, top);
+		return 0;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->pending_index);
+	luaL_unref(L, LUA_REGISTRYINDEX, l->pending_index);
+	lua_newtable(L);
+	l->pending_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	l->n = 0;
+
+	/* prepare a quiet get per distinct key; the requests table anchors the keys */
+	opstart(m, &t);
+	ops = lua_newuserdata(L, n * sizeof(op_t));
+	lua_newtable(L);  /* key -> opaque */
+	j = 0;
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, top + 2, (lua_Integer)i + 1);
+		lua_rawgeti(L, -1, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, top + 4);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			ops[j].k = k;
+			checkkey(L, m, lua_gettop(L), &ops[j].k);
+			opinit(&ops[j], PROTOCOL_BINARY_CMD_GETQ, MEMCACHED_REQUEST_GET_EXTRAS, 0,
+					(uint32_t)j);
+			lua_pushinteger(L, (lua_Integer)j);
+			lua_rawset(L, top + 4);
+			j++;
 		} else {
-			backoff_ms *= 2;
+			lua_pop(L, 2);
 		}
-		ts.tv_sec = 0;
-		ts.tv_nsec = backoff_ms * 1000000;
-		(void)nanosleep(&ts, NULL);
-		goto redo;
+		lua_pop(L, 1);
+	}
 
-	case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL:
-		lua_pushnil(L);
-		return 1;
+	/* send requests */
+	sendops(L, m, ops, j);
+
+	/* read responses; quiet gets only respond on hits, and errors are raised once the pipeline
+	 * is drained */
+	lua_createtable(L, j <= INT_MAX ? (int)j : INT_MAX, 0);
+	lua_pushnil(L);
+	error = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	hits = 0;
+	while (1) {
+		nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_EXTRAS
+				| MEMCACHED_VALUE | MEMCACHED_VALUE_BUFFER);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			lua_pop(L, nret);
+			break;
+		}
+		if (opaque >= j) {
+			return protocolerror(L, m);
+		}
+		switch (status) {
+		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
+			if (decodeitem(L, m, nret)) {
+				lua_rawseti(L, top + 5, (lua_Integer)opaque + 1);
+			} else if (lua_isnil(L, top + 6)) {
+				lua_replace(L, top + 6);
+			} else {
+				lua_pop(L, 1);
+			}
+			hits++;
+			break;
+
+		case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+			lua_pop(L, nret);
+			break;
+
+		default:
+			lua_pop(L, nret);
+			if (error == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+				error = status;
+			}
+		}
+	}
+	if (!lua_isnil(L, top + 6)) {
+		lua_pushvalue(L, top + 6);
+		return lua_error(L);
+	}
+	if (error != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)error);
+	}
+
+	tally(m, MEMCACHED_TALLY_MISSES, j - hits);
 
-	default:
-		return luaL_error(L, "memcached error (%d)", (int)status);
+	/* complete the requests */
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, top + 2, (lua_Integer)i + 1);
+		lua_rawgeti(L, -1, 1);
+		lua_rawget(L, top + 4);
+		lua_rawgeti(L, top + 5, lua_tointeger(L, -1) + 1);
+		lua_rawseti(L, -3, 2);
+		lua_pop(L, 1);
+		lua_pushboolean(L, 1);
+		lua_rawseti(L, -2, 3);
+		lua_pop(L, 1);
 	}
+	opend(L, m, MEMCACHED_METRIC_MULTI, NULL, &t);
+	lua_settop(L, top);
+	return 0;
 }
 
-static int flush (lua_State *L) {
-	uint16_t                       status;
-	lua_Integer                    expiration;
-	memcached_t                   *m;
-	protocol_binary_request_flush  request;
+static int mloader (lua_State *L) {
+	mkey_t     k;
+	loader_t  *l;
 
 	/* check arguments */
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	expiration = luaL_optinteger(L, 2, 0);
-	luaL_argcheck(L, expiration >= 0 && expiration <= UINT32_MAX, 2, "bad expiration");
+	checkmemcached(L, 1, &k);
 
-	/* prepare request */
-	memset(&request, 0, sizeof(request));
-	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_FLUSH;
-	request.message.header.request.extlen = MEMCACHED_REQUEST_FLUSH_EXTRAS;
-	request.message.header.request.bodylen = htobe32((uint32_t)MEMCACHED_REQUEST_FLUSH_EXTRAS);
-	request.message.body.expiration = htobe32((uint32_t)expiration);
+	/* create loader */
+	l = lua_newuserdata(L, sizeof(loader_t));
+	memset(l, 0, sizeof(loader_t));
+	l->memcached_index = l->pending_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_LOADER_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	l->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_newtable(L);
+	l->pending_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
 
-	/* send request */
-	getsocket(L, m);
-	sendnosig(L, m, &request, sizeof(request.bytes));
+static int loader_get (lua_State *L) {
+	mkey_t        k;
+	memcached_t  *m;
+	loader_t     *l;
 
-	/* read response */
-	recvresponse(L, m, &status, NULL, 0);
-	switch (status) {
-	case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-		return 0;
+	/* check arguments */
+	l = luaL_checkudata(L, 1, MEMCACHED_LOADER_METATABLE);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->memcached_index);
+	m = checkmemcached(L, lua_gettop(L), &k);
+	checkkey(L, m, 2, &k);
+	lua_settop(L, 2);
+
+	/* queue request { key, value, done }, kept on the stack across the yield */
+	lua_createtable(L, 3, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, l->pending_index);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, (lua_Integer)++l->n);
+	lua_pop(L, 1);
 
-	default:
-		return luaL_error(L, "memcached error (%d)", (int)status);
+	/* yield, so that the gets of other coroutines join the batch; outside coroutines, the
+	 * batch is dispatched immediately */
+	if (lua_isyieldable(L)) {
+		return lua_yieldk(L, 0, 0, loader_getk);
 	}
+	return loader_getk(L, LUA_OK, 0);
 }
 
-static int stats (lua_State *L) {
-	int                            nret;
-	size_t                         keylen;
-	uint16_t                       status;
-	const char                    *key;
-	memcached_t                   *m;
-	struct iovec                   iov[2];
-	protocol_binary_request_stats  request;
+static int loader_getk (lua_State *L, int status, lua_KContext ctx) {
+	loader_t  *l;
+
+	(void)status;
+	(void)ctx;
+	lua_settop(L, 3);
+	l = luaL_checkudata(L, 1, MEMCACHED_LOADER_METATABLE);
+
+	/* the first coroutine resumed dispatches the batch */
+	lua_rawgeti(L, 3, 3);
+	if (!lua_toboolean(L, -1)) {
+		dispatch(L, l);
+		lua_rawgeti(L, 3, 3);
+		if (!lua_toboolean(L, -1)) {
+			return luaL_error(L, "batch failed");
+		}
+	}
+	lua_rawgeti(L, 3, 2);
+	return 1;
+}
 
-	/* check arguments */
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	key = luaL_optlstring(L, 2, NULL, &keylen);
-	luaL_argcheck(L, !key || (keylen > 0 && keylen <= UINT16_MAX), 2, "bad key length");
+static int loader_dispatch (lua_State *L) {
+	loader_t  *l;
 
-	/* prepare request */
-	memset(&request, 0, sizeof(request));
-	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_STAT;
-	request.message.header.request.extlen = MEMCACHED_REQUEST_STATS_EXTRAS;
-	request.message.header.request.keylen = htobe16((uint16_t)keylen);
-	request.message.header.request.bodylen = htobe32((uint32_t)(MEMCACHED_REQUEST_STATS_EXTRAS
-			+ keylen));
+	l = luaL_checkudata(L, 1, MEMCACHED_LOADER_METATABLE);
+	dispatch(L, l);
+	return 0;
+}
 
-	/* send request */
-	getsocket(L, m);
-	iov[0].iov_base = &request;
-	iov[0].iov_len = sizeof(request.bytes);
-	iov[1].iov_base = (void *)key;
-	iov[1].iov_len = (uint16_t)keylen;
-	sendmsgnosig(L, m, iov, key ? 2 : 1);
+static int loader_free (lua_State *L) {
+	loader_t  *l;
 
-	/* read response */
-	lua_newtable(L);
+	l = luaL_checkudata(L, 1, MEMCACHED_LOADER_METATABLE);
+	if (l->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->memcached_index);
+		l->memcached_index = LUA_NOREF;
+	}
+	if (l->pending_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, l->pending_index);
+		l->pending_index = LUA_NOREF;
+	}
+	return 0;
+}
+
+static int loader_tostring (lua_State *L) {
+	loader_t  *l;
+
+	l = luaL_checkudata(L, 1, MEMCACHED_LOADER_METATABLE);
+	lua_pushfstring(L, MEMCACHED_LOADER_METATABLE ": %p", l);
+	return 1;
+}
+
+
+/*
+ * prefetch
+ */
+
+static int drainprefetch (lua_State *L, memcached_t *m) {
+	int          nret;
+	size_t       hits;
+	uint16_t     status, error;
+	uint32_t     opaque;
+	prefetch_t  *p;
+
+	/* detach first, so errors leave the prefetch incomplete rather than re-entered */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->prefetch_index);
+	p = lua_touserdata(L, -1);
+	luaL_unref(L, LUA_REGISTRYINDEX, m->prefetch_index);
+	m->prefetch_index = LUA_NOREF;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->keys_index);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->values_index);
+
+	/* read responses; quiet gets only respond on hits, and errors are raised once the pipeline
+	 * is drained, as the socket serves the operation that drains the prefetch */
+	lua_pushnil(L);
+	error = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+	hits = 0;
 	while (1) {
-		nret = recvresponse(L, m, &status, NULL, MEMCACHED_KEY | MEMCACHED_VALUE);
+		nret = recvresponse(L, m, &status, NULL, &opaque, MEMCACHED_EXTRAS | MEMCACHED_VALUE
+				| MEMCACHED_VALUE_BUFFER);
+		if (opaque == MEMCACHED_OPAQUE_NOOP) {
+			lua_pop(L, nret);
+			break;
+		}
+		if (opaque >= p->n) {
+			return protocolerror(L, m);
+		}
 		switch (status) {
 		case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-			switch (nret) {
-			case 1:
-				lua_pop(L, 1);  /* pop empty value */
-				return 1;
-			
-			case 2:
-				lua_rawset(L, -3);
-				break;
-
-			default:
-				return luaL_error(L, "protocol error");
+			if (decodeitem(L, m, nret)) {
+				lua_rawgeti(L, -4, (lua_Integer)opaque + 1);
+				lua_insert(L, -2);
+				lua_rawset(L, -4);
+			} else if (lua_isnil(L, -2)) {
+				lua_replace(L, -2);
+			} else {
+				lua_pop(L, 1);
 			}
+			hits++;
+			break;
+
+		case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+			lua_pop(L, nret);
 			break;
 
 		default:
-			return luaL_error(L, "memcached error (%d)", (int)status);
+			lua_pop(L, nret);
+			if (error == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+				error = status;
+			}
 		}
 	}
+	tally(m, MEMCACHED_TALLY_MISSES, p->n - hits);
+	if (!lua_isnil(L, -1)) {
+		return lua_error(L);
+	}
+	if (error != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+		return luaL_error(L, "memcached error (%d)", (int)error);
+	}
+	p->done = 1;
+	lua_pop(L, 4);
+	return 0;
 }
 
-static int quit (lua_State *L) {
-	memcached_t                   *m;
-	protocol_binary_request_quit  request;
+static int mprefetch (lua_State *L) {
+	size_t        n, i;
+	mkey_t        k;
+	memcached_t  *m;
+	prefetch_t   *p;
+	op_t         *ops;
 
 	/* check arguments */
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-
-	/* prepare request */
-	memset(&request, 0, sizeof(request));
-	request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-	request.message.header.request.opcode = PROTOCOL_BINARY_CMD_QUITQ;
-
-	/* send request */
-	sendnosig(L, m, &request, sizeof(request.bytes));
-
-	return 0;
+	m = checkmemcached(L, 1, &k);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	/* create prefetch */
+	p = lua_newuserdata(L, sizeof(prefetch_t));
+	memset(p, 0, sizeof(prefetch_t));
+	p->memcached_index = p->keys_index = p->values_index = LUA_NOREF;
+	luaL_getmetatable(L, MEMCACHED_PREFETCH_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	p->memcached_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_newtable(L);
+	p->values_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* prepare a quiet get per key; the copied keys table anchors the keys */
+	n = lua_rawlen(L, 2);
+	luaL_argcheck(L, n < MEMCACHED_OPAQUE_ASYNC, 2, "too many keys");
+	lua_createtable(L, n <= INT_MAX ? (int)n : INT_MAX, 0);
+	ops = lua_newuserdata(L, n * sizeof(op_t) + 1);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 2, (lua_Integer)i + 1);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "bad key");
+		ops[i].k = k;
+		checkkey(L, m, lua_gettop(L), &ops[i].k);
+		opinit(&ops[i], PROTOCOL_BINARY_CMD_GETQ, MEMCACHED_REQUEST_GET_EXTRAS, 0, (uint32_t)i);
+		lua_rawseti(L, 4, (lua_Integer)i + 1);
+	}
+	lua_pushvalue(L, 4);
+	p->keys_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	p->n = n;
+
+	/* send requests without reading the responses; this reads the responses of a previous
+	 * prefetch, if any */
+	sendops(L, m, ops, n);
+	lua_pushvalue(L, 3);
+	m->prefetch_index = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
 }
 
-static int mclose (lua_State *L) {
+static int prefetch_result (lua_State *L) {
+	mkey_t        k;
 	memcached_t  *m;
-
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	m->closed = 1;
-	if (m->host_index != LUA_NOREF) {
-		luaL_unref(L, LUA_REGISTRYINDEX, m->host_index);
-		m->host_index = LUA_NOREF;
+	prefetch_t   *p;
+
+	/* read the responses, unless another operation has already read them */
+	p = luaL_checkudata(L, 1, MEMCACHED_PREFETCH_METATABLE);
+	if (!p->done && p->memcached_index != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, p->memcached_index);
+		m = checkmemcached(L, lua_gettop(L), &k);
+		if (m->prefetch_index != LUA_NOREF) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, m->prefetch_index);
+			if (lua_touserdata(L, -1) == p) {
+				drainprefetch(L, m);
+			}
+		}
 	}
-	if (m->port_index != LUA_NOREF) {
-		luaL_unref(L, LUA_REGISTRYINDEX, m->port_index);
-		m->port_index = LUA_NOREF;
+	if (!p->done) {
+		return luaL_error(L, "prefetch failed");
 	}
-	if (m->encode_index != LUA_NOREF) {
-		luaL_unref(L, LUA_REGISTRYINDEX, m->encode_index);
-		m->encode_index = LUA_NOREF;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->values_index);
+	return 1;
+}
+
+static int prefetch_free (lua_State *L) {
+	prefetch_t  *p;
+
+	p = luaL_checkudata(L, 1, MEMCACHED_PREFETCH_METATABLE);
+	if (p->memcached_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, p->memcached_index);
+		p->memcached_index = LUA_NOREF;
 	}
-	if (m->decode_index != LUA_NOREF) {
-		luaL_unref(L, LUA_REGISTRYINDEX, m->decode_index);
-		m->decode_index = LUA_NOREF;
+	if (p->keys_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, p->keys_index);
+		p->keys_index = LUA_NOREF;
 	}
-	if (m->fd >= 0) {
-		/* send quit command */
-		lua_pushcfunction(L, quit);
-		lua_pushvalue(L, 1);
-		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
-			/* ignore error, if any */
-			lua_pop(L, 1);
-		}
-
-		/* close socket */
-		close(m->fd);
-		m->fd = -1;
+	if (p->values_index != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, p->values_index);
+		p->values_index = LUA_NOREF;
 	}
 	return 0;
 }
 
-static int tostring (lua_State *L) {
-	const char   *state;
-	memcached_t  *m;
+static int prefetch_tostring (lua_State *L) {
+	prefetch_t  *p;
 
-	m = luaL_checkudata(L, 1, MEMCACHED_METATABLE);
-	if (m->closed) {
-		state = "closed";
-	} else if (m->fd < 0) {
-		state = "disconnected";
-	} else {
-		state = "connected";
-	}
-	lua_pushfstring(L, MEMCACHED_METATABLE " [%s]: %p", state, m);
+	p = luaL_checkudata(L, 1, MEMCACHED_PREFETCH_METATABLE);
+	lua_pushfstring(L, MEMCACHED_PREFETCH_METATABLE ": %p", p);
 	return 1;
 }
 
@@ -1421,6 +6542,14 @@ int luaopen_memcached (lua_State *L) {
 	/* register functions */
 	luaL_newlib(L, functions);
 
+	/* create module totals, shared by the instances */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, MEMCACHED_TOTALS) == LUA_TNIL) {
+		memset(lua_newuserdata(L, MEMCACHED_TALLIES * sizeof(uint64_t)), 0,
+				MEMCACHED_TALLIES * sizeof(uint64_t));
+		lua_setfield(L, LUA_REGISTRYINDEX, MEMCACHED_TOTALS);
+	}
+	lua_pop(L, 1);
+
 	/* create buffer metatable */
 	luaL_newmetatable(L, MEMCACHED_BUFFER_METATABLE);
 	lua_pushcfunction(L, buffer_free);
@@ -1447,20 +6576,258 @@ int luaopen_memcached (lua_State *L) {
 	lua_pushinteger(L, PROTOCOL_BINARY_CMD_REPLACE);
 	lua_pushcclosure(L, set, 1);
 	lua_setfield(L, -2, "replace");
+	lua_pushcfunction(L, update);
+	lua_setfield(L, -2, "update");
+	lua_pushcfunction(L, setdelta);
+	lua_setfield(L, -2, "set_delta");
+	lua_pushcfunction(L, setasync);
+	lua_setfield(L, -2, "set_async");
+	lua_pushcfunction(L, mbatch);
+	lua_setfield(L, -2, "batch");
+	lua_pushcfunction(L, mloader);
+	lua_setfield(L, -2, "loader");
+	lua_pushcfunction(L, mprefetch);
+	lua_setfield(L, -2, "prefetch");
+	lua_pushcfunction(L, gat);
+	lua_setfield(L, -2, "gat");
+	lua_pushcfunction(L, touch);
+	lua_setfield(L, -2, "touch");
+	lua_pushcfunction(L, touchmulti);
+	lua_setfield(L, -2, "touch_multi");
 	lua_pushinteger(L, PROTOCOL_BINARY_CMD_INCREMENT);
 	lua_pushcclosure(L, incr, 1);
 	lua_setfield(L, -2, "inc");
 	lua_pushinteger(L, PROTOCOL_BINARY_CMD_DECREMENT);
 	lua_pushcclosure(L, incr, 1);
 	lua_setfield(L, -2, "dec");
+	lua_pushcfunction(L, incmulti);
+	lua_setfield(L, -2, "inc_multi");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_APPENDQ);
+	lua_pushcclosure(L, append, 1);
+	lua_setfield(L, -2, "append");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_PREPENDQ);
+	lua_pushcclosure(L, append, 1);
+	lua_setfield(L, -2, "prepend");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_APPENDQ);
+	lua_pushcclosure(L, appendmulti, 1);
+	lua_setfield(L, -2, "append_multi");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_PREPENDQ);
+	lua_pushcclosure(L, appendmulti, 1);
+	lua_setfield(L, -2, "prepend_multi");
 	lua_pushcfunction(L, flush);
 	lua_setfield(L, -2, "flush");
 	lua_pushcfunction(L, stats);
 	lua_setfield(L, -2, "stats");
+	lua_pushcfunction(L, mnamespace);
+	lua_setfield(L, -2, "namespace");
+	lua_pushcfunction(L, mcounter);
+	lua_setfield(L, -2, "counter");
+	lua_pushcfunction(L, mshardedcounter);
+	lua_setfield(L, -2, "sharded_counter");
+	lua_pushcfunction(L, ratelimit);
+	lua_setfield(L, -2, "rate_limit");
+	lua_pushcfunction(L, mlock);
+	lua_setfield(L, -2, "lock");
+	lua_pushcfunction(L, mlist);
+	lua_setfield(L, -2, "list");
+	lua_pushcfunction(L, flushpending);
+	lua_setfield(L, -2, "flush_pending");
+	lua_pushcfunction(L, metrics);
+	lua_setfield(L, -2, "metrics");
+	lua_pushcfunction(L, slowlog);
+	lua_setfield(L, -2, "slowlog");
+	lua_pushcfunction(L, hotkeys);
+	lua_setfield(L, -2, "hotkeys");
+	lua_pushcfunction(L, sizereport);
+	lua_setfield(L, -2, "size_report");
 	lua_pushcfunction(L, mclose);
 	lua_setfield(L, -2, "close");
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	/* create namespace metatable */
+	luaL_newmetatable(L, MEMCACHED_NAMESPACE_METATABLE);
+	lua_pushcfunction(L, namespace_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, namespace_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, get);
+	lua_setfield(L, -2, "get");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_SET);
+	lua_pushcclosure(L, set, 1);
+	lua_setfield(L, -2, "set");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_ADD);
+	lua_pushcclosure(L, set, 1);
+	lua_setfield(L, -2, "add");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_REPLACE);
+	lua_pushcclosure(L, set, 1);
+	lua_setfield(L, -2, "replace");
+	lua_pushcfunction(L, update);
+	lua_setfield(L, -2, "update");
+	lua_pushcfunction(L, setdelta);
+	lua_setfield(L, -2, "set_delta");
+	lua_pushcfunction(L, setasync);
+	lua_setfield(L, -2, "set_async");
+	lua_pushcfunction(L, mbatch);
+	lua_setfield(L, -2, "batch");
+	lua_pushcfunction(L, mloader);
+	lua_setfield(L, -2, "loader");
+	lua_pushcfunction(L, mprefetch);
+	lua_setfield(L, -2, "prefetch");
+	lua_pushcfunction(L, gat);
+	lua_setfield(L, -2, "gat");
+	lua_pushcfunction(L, touch);
+	lua_setfield(L, -2, "touch");
+	lua_pushcfunction(L, touchmulti);
+	lua_setfield(L, -2, "touch_multi");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_INCREMENT);
+	lua_pushcclosure(L, incr, 1);
+	lua_setfield(L, -2, "inc");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_DECREMENT);
+	lua_pushcclosure(L, incr, 1);
+	lua_setfield(L, -2, "dec");
+	lua_pushcfunction(L, incmulti);
+	lua_setfield(L, -2, "inc_multi");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_APPENDQ);
+	lua_pushcclosure(L, append, 1);
+	lua_setfield(L, -2, "append");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_PREPENDQ);
+	lua_pushcclosure(L, append, 1);
+	lua_setfield(L, -2, "prepend");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_APPENDQ);
+	lua_pushcclosure(L, appendmulti, 1);
+	lua_setfield(L, -2, "append_multi");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_PREPENDQ);
+	lua_pushcclosure(L, appendmulti, 1);
+	lua_setfield(L, -2, "prepend_multi");
+	lua_pushcfunction(L, invalidate);
+	lua_setfield(L, -2, "invalidate");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create counter metatable */
+	luaL_newmetatable(L, MEMCACHED_COUNTER_METATABLE);
+	lua_pushcfunction(L, counter_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, counter_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushinteger(L, 1);
+	lua_pushcclosure(L, counter_inc, 1);
+	lua_setfield(L, -2, "inc");
+	lua_pushinteger(L, -1);
+	lua_pushcclosure(L, counter_inc, 1);
+	lua_setfield(L, -2, "dec");
+	lua_pushcfunction(L, counter_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, counter_flush);
+	lua_setfield(L, -2, "flush");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create sharded counter metatable */
+	luaL_newmetatable(L, MEMCACHED_SHARDEDCOUNTER_METATABLE);
+	lua_pushcfunction(L, shardedcounter_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, shardedcounter_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, shardedcounter_inc);
+	lua_setfield(L, -2, "inc");
+	lua_pushcfunction(L, shardedcounter_get);
+	lua_setfield(L, -2, "get");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create lock metatable */
+	luaL_newmetatable(L, MEMCACHED_LOCK_METATABLE);
+	lua_pushcfunction(L, lock_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lock_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, lock_token);
+	lua_setfield(L, -2, "token");
+	lua_pushcfunction(L, lock_release);
+	lua_setfield(L, -2, "release");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create list metatable */
+	luaL_newmetatable(L, MEMCACHED_LIST_METATABLE);
+	lua_pushcfunction(L, list_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, list_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, list_push);
+	lua_setfield(L, -2, "push");
+	lua_pushcfunction(L, list_range);
+	lua_setfield(L, -2, "range");
+	lua_pushcfunction(L, list_range);
+	lua_setfield(L, -2, "all");
+	lua_pushcfunction(L, list_compact);
+	lua_setfield(L, -2, "compact");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create batch metatable */
+	luaL_newmetatable(L, MEMCACHED_BATCH_METATABLE);
+	lua_pushcfunction(L, batch_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, batch_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_GET);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "get");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_SET);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "set");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_ADD);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "add");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_REPLACE);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "replace");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_INCREMENT);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "inc");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_DECREMENT);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "dec");
+	lua_pushinteger(L, PROTOCOL_BINARY_CMD_TOUCH);
+	lua_pushcclosure(L, batch_op, 1);
+	lua_setfield(L, -2, "touch");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create loader metatable */
+	luaL_newmetatable(L, MEMCACHED_LOADER_METATABLE);
+	lua_pushcfunction(L, loader_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, loader_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, loader_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, loader_dispatch);
+	lua_setfield(L, -2, "dispatch");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* create prefetch metatable */
+	luaL_newmetatable(L, MEMCACHED_PREFETCH_METATABLE);
+	lua_pushcfunction(L, prefetch_free);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, prefetch_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	lua_pushcfunction(L, prefetch_result);
+	lua_setfield(L, -2, "result");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	return 1;
 }
\ No newline at end of file
@@ -12,8 +12,16 @@
 #include <lua.h>
 
 
-#define MEMCACHED_METATABLE         "memcached"
-#define MEMCACHED_BUFFER_METATABLE  "memcached.buffer"
+#define MEMCACHED_METATABLE                 "memcached"
+#define MEMCACHED_BUFFER_METATABLE          "memcached.buffer"
+#define MEMCACHED_NAMESPACE_METATABLE       "memcached.namespace"
+#define MEMCACHED_COUNTER_METATABLE         "memcached.counter"
+#define MEMCACHED_SHARDEDCOUNTER_METATABLE  "memcached.shardedcounter"
+#define MEMCACHED_LOCK_METATABLE            "memcached.lock"
+#define MEMCACHED_LIST_METATABLE            "memcached.list"
+#define MEMCACHED_BATCH_METATABLE           "memcached.batch"
+#define MEMCACHED_LOADER_METATABLE          "memcached.loader"
+#define MEMCACHED_PREFETCH_METATABLE        "memcached.prefetch"
 
 
 typedef struct memcached_buffer {
@@ -107,6 +107,43 @@ local function testOpenClose ()
 	client:close()
 end
 
+local function testPrefix ()
+	local client = memcached.open({ prefix = PREFIX .. "-test-prefix-" })
+	assert(client)
+	local plain = memcached.open()
+	assert(plain)
+	local value = "test-value"
+	assert(client:set("key", value))
+	assert(client:get("key") == value)
+	assert(plain:get(PREFIX .. "-test-prefix-key") == value)
+	assert(client:inc("counter") == 1)
+	assert(plain:inc(PREFIX .. "-test-prefix-counter") == 2)
+	assert(client:set("key", nil))
+	assert(plain:get(PREFIX .. "-test-prefix-key") == nil)
+	client:close()
+	plain:close()
+end
+
+local function testKeys ()
+	local client = memcached.open({ keylimit = 250, keycheck = true })
+	assert(client)
+	local value = "test-value"
+
+	-- Long keys
+	local key = PREFIX .. "-test-keys-" .. string.rep("x", 500)
+	assert(client:set(key, value))
+	assert(client:get(key) == value)
+	assert(client:get(key .. "y") == nil)
+	assert(client:set(key, nil))
+
+	-- Bad keys
+	assert(not pcall(client.get, client, "bad key"))
+	assert(not pcall(client.set, client, "bad\nkey", value))
+	assert(not pcall(memcached.open, { keylimit = 32 }))
+
+	client:close()
+end
+
 local function testSetGet ()
 	local client = memcached.open()
 	assert(client)
@@ -162,6 +199,70 @@ local function testExpiration ()
 	client:close()
 end
 
+local function testJitter ()
+	local client = memcached.open({ jitter = 0.5 })
+	assert(client)
+	local key = PREFIX .. "-test-jitter"
+	local value = "test-value"
+	assert(client:set(key, value, 60))
+	assert(client:get(key) == value)
+	assert(client:inc(key .. "-counter", 1, 1, 60) == 1)
+
+	-- Absolute expiration in the past
+	assert(client:set(key, value, 31 * 24 * 3600))
+	assert(client:get(key) == nil)
+
+	-- Absolute expiration near the maximum
+	assert(client:set(key, value, 0xffffffff))
+	assert(client:get(key) == value)
+
+	-- Absolute expiration
+	assert(client:set(key, value, os.time() + 60))
+	assert(client:get(key) == value)
+
+	client:close()
+end
+
+local function testXFetch ()
+	local client = memcached.open({ xfetch = 1 })
+	assert(client)
+	local key = PREFIX .. "-test-xfetch"
+	local value = { a = 1 }
+
+	-- No recompute cost: no early refresh
+	assert(client:set(key, value, 60))
+	local result, cas, refresh = client:get(key)
+	assert(equals(result, value))
+	assert(math.type(cas) == "integer")
+	assert(refresh == false)
+
+	-- Very high recompute cost: early refresh (almost certain per read; bounded retries)
+	assert(client:set(key, value, 60, nil, 1e6))
+	for _ = 1, 10 do
+		result, cas, refresh = client:get(key)
+		assert(equals(result, value))
+		if refresh then
+			break
+		end
+	end
+	assert(refresh == true)
+
+	-- No expiration: no envelope
+	assert(client:set(key, value))
+	result, cas, refresh = client:get(key)
+	assert(equals(result, value))
+	assert(refresh == nil)
+
+	-- Envelope is transparent to instances without XFetch
+	assert(client:set(key, value, 60, nil, 1))
+	client:close()
+	client = memcached.open()
+	result, cas, refresh = client:get(key)
+	assert(equals(result, value))
+	assert(refresh == nil)
+	client:close()
+end
+
 local function testCas ()
 	local client = memcached.open()
 	assert(client)
@@ -190,6 +291,43 @@ local function testCas ()
 	client:close()
 end
 
+local function testUpdate ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-update"
+
+	-- Update missing and present key
+	local function append (value)
+		value = value or { }
+		table.insert(value, #value + 1)
+		return value
+	end
+	local value, cas = client:update(key, append, 60)
+	assert(equals(value, { 1 }))
+	assert(math.type(cas) == "integer")
+	value = client:update(key, append)
+	assert(equals(value, { 1, 2 }))
+	assert(equals(client:get(key), { 1, 2 }))
+
+	-- Conflict
+	local conflicts = 0
+	value = client:update(key, function (current)
+		if conflicts == 0 then
+			conflicts = conflicts + 1
+			assert(client:set(key, { 10 }))
+		end
+		return append(current)
+	end)
+	assert(conflicts == 1)
+	assert(equals(value, { 10, 2 }))
+
+	-- Abandoned update
+	assert(client:update(key, function () return nil end) == nil)
+	assert(equals(client:get(key), { 10, 2 }))
+
+	client:close()
+end
+
 local function testAddReplace ()
 	local client = memcached.open()
 	assert(client)
@@ -243,6 +381,611 @@ function testIncDec ()
 	client:close()
 end
 
+function testTouch ()
+	local client = memcached.open()
+	assert(client)
+	local key1, key2 = PREFIX .. "-test-touch-1", PREFIX .. "-test-touch-2"
+	client:set(key1, "value", 1)
+	client:set(key2, nil)
+
+	-- Get and touch
+	local value, cas = client:gat(key1, 60)
+	assert(value == "value" and cas)
+	assert(client:gat(key2, 60) == nil)
+
+	-- Touch
+	assert(client:touch(key1, 60))
+	assert(client:touch(key2, 60) == false)
+	local result = client:touch_multi({ key1, key2 }, 60)
+	assert(result[key1] == true and result[key2] == false)
+	client:close()
+end
+
+function testCanonical ()
+	-- Same content, different insertion order
+	local t1, t2 = { 1, 2, 3 }, {}
+	for i = 1, 40 do
+		t1["k" .. i] = i
+		t1[i * 0.5 + 100] = true
+	end
+	for i = 40, 1, -1 do
+		t2[i * 0.5 + 100] = true
+		t2["k" .. i] = i
+	end
+	t2[3], t2[2], t2[1] = 3, 2, 1
+	t2.tmp = 0
+	t2.tmp = nil
+	local e1 = tostring(memcached.encode(t1, false, true))
+	local e2 = tostring(memcached.encode(t2, false, true))
+	assert(e1 == e2)
+	local t = memcached.decode(e1)
+	assert(t[3] == 3 and t.k40 == 40 and t[120] == true and t[100.5] == true)
+
+	-- Small tables
+	assert(tostring(memcached.encode({ a = 1, b = 2, [false] = 1 }, false, true))
+			== tostring(memcached.encode({ [false] = 1, b = 2, a = 1 }, false, true)))
+
+	-- Unsupported values are skipped, as without canonical encoding
+	t = memcached.decode(memcached.encode({ a = print, b = 1 }, false, true))
+	assert(t.a == nil and t.b == 1)
+	t = memcached.decode(memcached.encode({ 1, print, 3 }, false, true))
+	assert(t[1] == 1 and t[2] == nil and t[3] == 3)
+	local client = memcached.open({ canonical = true })
+	local key = PREFIX .. "-test-canonical"
+	assert(client:set(key, { a = print, b = 1 }))
+	assert(client:get(key).b == 1)
+	client:set(key, nil)
+	client:close()
+end
+
+function testDedup ()
+	local client = memcached.open({ dedup = 16 })
+	local other = memcached.open()
+	assert(client and other)
+	local key = PREFIX .. "-test-dedup"
+
+	-- Unchanged value is touched, not resent
+	local _, cas = client:set(key, "value", 60)
+	local _, cas2 = client:set(key, "value", 60)
+	assert(cas2 == cas)
+
+	-- Changed value, or item changed by another client
+	local _, cas3 = client:set(key, "value2", 60)
+	assert(cas3 ~= cas2)
+	other:set(key, "other")
+	client:set(key, "value2", 60)
+	assert(client:get(key) == "value2")
+	client:close()
+	other:close()
+end
+
+function testSetDelta ()
+	local client = memcached.open({ deltas = 65536 })
+	assert(client)
+	local key = PREFIX .. "-test-set-delta"
+	local profile = { name = "name", visits = 1, tags = { "a", "b" }, address = { city = "city" } }
+	assert(client:set(key, profile))
+
+	-- Patch
+	local value, cas = client:get(key)
+	value.visits = 2
+	value.tags[3] = "c"
+	value.address.city = nil
+	value.address.zip = "zip"
+	local ok, cas2 = client:set_delta(key, value, cas)
+	assert(ok and cas2 ~= cas)
+	value = client:get(key)
+	assert(value.visits == 2 and value.name == "name" and #value.tags == 3)
+	assert(value.address.city == nil and value.address.zip == "zip")
+
+	-- Chained patch, and conflict
+	value.visits = 3
+	ok, cas = client:set_delta(key, value, cas2)
+	assert(ok)
+	assert(client:get(key).visits == 3)
+	assert(not client:set_delta(key, value, cas2))
+	client:close()
+
+	-- Custom decode function: full encoding
+	client = memcached.open({ deltas = 65536, decode = function (encoding)
+		return memcached.decode(encoding)
+	end })
+	value, cas = client:get(key)
+	value.visits = 4
+	assert(client:set_delta(key, value, cas))
+	value = client:get(key)
+	assert(value.visits == 4 and value.name == "name")
+	client:close()
+end
+
+function testAppend ()
+	local client = memcached.open()
+	assert(client)
+	local key1, key2 = PREFIX .. "-test-append-1", PREFIX .. "-test-append-2"
+	client:set(key1, nil)
+	client:set(key2, nil)
+
+	-- Records
+	local e = tostring(memcached.encode(1, true)) .. tostring(memcached.encode({ a = 2 }, true))
+	local records = memcached.decode(e)
+	assert(#records == 2 and records[1] == 1 and records[2].a == 2)
+
+	-- Append and prepend
+	assert(client:append(key1, "b", 60))
+	assert(client:append(key1, "c"))
+	assert(client:prepend(key1, "a"))
+	records = client:get(key1)
+	assert(#records == 3 and records[1] == "a" and records[2] == "b" and records[3] == "c")
+
+	-- Multi
+	assert(client:append_multi({ [key1] = "d", [key2] = "x" }, 60))
+	assert(client:prepend_multi({ [key2] = "w" }))
+	assert(#client:get(key1) == 4 and client:get(key1)[4] == "d")
+	records = client:get(key2)
+	assert(#records == 2 and records[1] == "w" and records[2] == "x")
+
+	-- Records concatenated with a set value
+	assert(client:set(key2, "v"))
+	assert(client:append(key2, "x"))
+	local ok, err = pcall(client.get, client, key2)
+	assert(not ok and string.find(err, "without record framing"))
+	client:set(key2, nil)
+	client:close()
+end
+
+function testSetAsync ()
+	local client = memcached.open({ queue = 256 })
+	assert(client)
+	local key = PREFIX .. "-test-set-async"
+
+	-- Queued writes are sent before the next synchronous operation
+	for i = 1, 20 do
+		assert(client:set_async(key .. "-" .. i, i, 60))
+	end
+	assert(client:get(key .. "-20") == 20)
+	assert(client:get(key .. "-1") == 1)
+
+	-- Flush
+	assert(client:set_async(key, "async"))
+	local errors = client:flush_pending()
+	assert(next(errors) == nil)
+	assert(client:get(key) == "async")
+
+	-- Many writes without a synchronous operation
+	for i = 1, 10000 do
+		assert(client:set_async(key .. "-many", i, 60))
+	end
+	assert(next(client:flush_pending()) == nil)
+	assert(client:get(key .. "-many") == 10000)
+
+	-- Queued writes are flushed on close
+	assert(client:set_async(key, "closed"))
+	client:close()
+	client = memcached.open()
+	assert(client:get(key) == "closed")
+	client:close()
+end
+
+function testBatch ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-batch"
+	client:set(key .. "-1", "one")
+	client:set(key .. "-2", nil)
+	client:set(key .. "-3", nil)
+
+	-- Mixed operations
+	local results = client:batch(function (b)
+		assert(string.match(tostring(b), "^memcached.batch"))
+		b:get(key .. "-1")
+		b:get(key .. "-2")
+		b:set(key .. "-2", { a = 1 }, 60)
+		b:add(key .. "-1", "x")
+		b:inc(key .. "-3", 2, 5)
+		b:inc(key .. "-3", 2)
+		b:touch(key .. "-1", 60)
+		b:set(key .. "-1", nil)
+		b:get(key .. "-2")
+	end)
+	assert(#results == 9)
+	assert(results[1] == "one" and results[2] == false)
+	assert(results[3] == true and results[4] == false)
+	assert(results[5] == 5 and results[6] == 7)
+	assert(results[7] == true and results[8] == true)
+	assert(results[9].a == 1)
+	assert(client:get(key .. "-1") == nil)
+
+	-- Empty batch
+	assert(#client:batch(function () end) == 0)
+
+	-- Large batch, sent in chunks
+	local value = string.rep("x", 10000)
+	results = client:batch(function (b)
+		for i = 1, 3000 do
+			b:set(key .. "-large-" .. i, value, 60)
+		end
+		for i = 1, 3000 do
+			b:get(key .. "-large-" .. i)
+		end
+	end)
+	assert(#results == 6000 and results[3000] == true and results[6000] == value)
+
+	-- Failing function
+	local saved
+	assert(not pcall(client.batch, client, function (b)
+		saved = b
+		error("failed")
+	end))
+	assert(not pcall(saved.get, saved, key .. "-1"))
+	client:close()
+end
+
+function testLoader ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-loader"
+	client:set(key .. "-1", "one")
+	client:set(key .. "-2", { two = 2 })
+	client:set(key .. "-3", nil)
+	local loader = client:loader()
+	assert(string.match(tostring(loader), "^memcached.loader"))
+
+	-- Coroutines, resumed in turn
+	local results = {}
+	local keys = { key .. "-1", key .. "-2", key .. "-3", key .. "-1" }
+	local cos = {}
+	for i, k in ipairs(keys) do
+		cos[i] = coroutine.create(function ()
+			results[i] = loader:get(k)
+		end)
+		assert(coroutine.resume(cos[i]))
+		assert(coroutine.status(cos[i]) == "suspended")
+	end
+	for i = 1, #cos do
+		assert(coroutine.resume(cos[i]))
+		assert(coroutine.status(cos[i]) == "dead")
+	end
+	assert(results[1] == "one" and results[2].two == 2 and results[3] == nil)
+	assert(results[4] == "one")
+
+	-- Outside coroutines
+	assert(loader:get(key .. "-1") == "one")
+	loader:dispatch()
+	client:close()
+end
+
+function testPrefetch ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-prefetch"
+	client:set(key .. "-1", "one")
+	client:set(key .. "-2", { two = 2 })
+	client:set(key .. "-3", nil)
+
+	-- Result
+	local prefetch = client:prefetch({ key .. "-1", key .. "-2", key .. "-3" })
+	assert(string.match(tostring(prefetch), "^memcached.prefetch"))
+	local values = prefetch:result()
+	assert(values[key .. "-1"] == "one" and values[key .. "-2"].two == 2)
+	assert(values[key .. "-3"] == nil)
+	assert(prefetch:result() == values)
+
+	-- Drained by the next operation
+	prefetch = client:prefetch({ key .. "-1" })
+	assert(client:get(key .. "-2").two == 2)
+	assert(prefetch:result()[key .. "-1"] == "one")
+	client:close()
+end
+
+function testMetrics ()
+	local client = memcached.open({ metrics = true })
+	assert(client)
+	local key = PREFIX .. "-test-metrics"
+	for i = 1, 10 do
+		client:set(key, { i = i })
+		assert(client:get(key).i == i)
+	end
+	client:inc(key .. "-inc")
+	local latency = client:metrics().latency
+	assert(latency.get.count == 10 and latency.set.count == 10 and latency.inc.count == 1)
+	assert(latency.touch == nil)
+	local total = latency.get.total
+	assert(total.mean > 0 and total.p50 <= total.p99 and total.p99 <= total.max)
+	assert(latency.get.network.mean + latency.get.codec.mean <= total.mean * 1.001)
+	assert(client:metrics(true).latency.get.count == 10)
+	assert(client:metrics().latency.get == nil)
+	client:close()
+
+	-- Counters
+	client = memcached.open()
+	local totals = memcached.metrics()
+	client:set(key, "value")
+	assert(client:get(key) == "value")
+	assert(client:get(key .. "-missing") == nil)
+	local metrics = client:metrics()
+	assert(metrics.connects == 1 and metrics.reconnects == 0)
+	assert(metrics.hits == 1 and metrics.misses == 1)
+	assert(metrics.sends == 3 and metrics.receives >= 3)
+	assert(metrics.bytes_sent > 0 and metrics.bytes_received > 0)
+	assert(next(metrics.errors) == nil)  -- misses are not errors
+	assert(memcached.metrics().hits == totals.hits + 1)
+	local text = memcached.prometheus(metrics)
+	assert(string.find(text, "memcached_client_hits_total 1\n", 1, true))
+	assert(not string.find(text, "memcached_client_errors_total{", 1, true))
+	assert(type(memcached.prometheus()) == "string")
+	assert(not pcall(client.set, client, key .. "-large", string.rep("x", 2 * 1024 * 1024)))
+	metrics = client:metrics()
+	assert(metrics.errors[3] == 1)  -- value too large
+	text = memcached.prometheus(metrics)
+	assert(string.find(text, "memcached_client_errors_total{status=\"3\"} 1\n", 1, true))
+	client:close()
+
+	-- Disabled
+	client = memcached.open()
+	assert(client:metrics().latency == nil)
+	client:close()
+end
+
+function testSlowLog ()
+	local key = PREFIX .. "-test-slowlog"
+	local client = memcached.open({ slow = 1e-9, slowlog = 2 })
+	assert(client)
+	client:set(key, "value")
+	assert(client:get(key) == "value")
+	client:inc(key .. "-inc")
+	local slowlog = client:slowlog(true)
+	assert(#slowlog == 2)
+	assert(slowlog[1].op == "get" and slowlog[1].key == key)
+	assert(slowlog[1].request > 0 and slowlog[1].response > 0)
+	assert(slowlog[1].total >= slowlog[1].network and slowlog[1].time > 0)
+	assert(slowlog[2].op == "inc")
+	assert(#client:slowlog() == 0)
+	client:inc(key .. "-inc")
+	client:close()
+	assert(#client:slowlog() == 0)
+
+	-- Handler
+	local ops = {}
+	client = memcached.open({ slow = 1e-9, slowhandler = function (op)
+		ops[#ops + 1] = op
+	end })
+	client:set(key, "value")
+	assert(#ops == 1 and ops[1].op == "set" and ops[1].key == key)
+	assert(#client:slowlog() == 0)
+	client:close()
+end
+
+function testHotKeys ()
+	local key = PREFIX .. "-test-hotkeys"
+	local client = memcached.open({ hotkeys = 2 })
+	assert(client)
+	for i = 1, 3 do
+		client:set("hot:" .. key .. "-" .. i, string.rep("x", i * 100))
+	end
+	for i = 1, 10 do
+		assert(client:get("hot:" .. key .. "-3"))
+	end
+	assert(client:get("hot:" .. key .. "-2"))
+	local hotkeys = client:hotkeys()
+	assert(#hotkeys == 2)
+	assert(hotkeys[1].key == "hot:" .. key .. "-3" and hotkeys[1].count >= 11)
+	assert(hotkeys[2].key == "hot:" .. key .. "-2")
+	assert(#client:hotkeys(1) == 1)
+	local report = client:size_report()
+	assert(report.hot.count == 14)
+	assert(report.hot.max >= 300 and report.hot.bytes > report.hot.max)
+	client:set("hot:" .. key .. "-1", nil)
+	client:close()
+
+	-- Disabled
+	client = memcached.open()
+	assert(#client:hotkeys() == 0 and next(client:size_report()) == nil)
+	client:close()
+end
+
+function testList ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-list"
+	client:set(key, nil)
+	local list = client:list(key, 5, 1024, 60)
+	assert(string.match(tostring(list), "^memcached.list"))
+	assert(#list:all() == 0)
+	for i = 1, 3 do
+		assert(list:push(i))
+	end
+	local all = list:all()
+	assert(#all == 3 and all[1] == 1 and all[3] == 3)
+	local range = list:range(-2)
+	assert(#range == 2 and range[1] == 2 and range[2] == 3)
+
+	-- Compaction
+	for i = 4, 10 do
+		list:push(i)
+	end
+	list:compact()
+	all = list:all()
+	assert(#all == 5 and all[1] == 6 and all[5] == 10)
+	for i = 1, 100 do
+		list:push(string.rep("x", 100))
+	end
+	assert(#client:list(key):all() <= 5)
+
+	-- Compaction with a new handle per push
+	for i = 1, 20 do
+		assert(client:list(key, 5, 1024, 60):push(string.rep("y", 100)))
+	end
+	assert(#client:list(key):all() < 20)
+	client:close()
+end
+
+function testIncMulti ()
+	local client = memcached.open()
+	assert(client)
+	local key1, key2, key3 = PREFIX .. "-test-inc-multi-1", PREFIX .. "-test-inc-multi-2",
+			PREFIX .. "-test-inc-multi-3"
+
+	-- Quiet
+	assert(client:inc_multi({ [key1] = 1, [key2] = 5 }, 10) == nil)
+	assert(client:inc(key1, 0) == 10)
+	assert(client:inc(key2, 0) == 10)
+
+	-- Values
+	client:set(key3, "not-a-number")
+	local values = client:inc_multi({ [key1] = 2, [key2] = -3, [key3] = 1 }, 0, 60, true)
+	assert(values[key1] == 12)
+	assert(values[key2] == 7)
+	assert(values[key3] == false)
+
+	-- Many keys
+	local deltas = { }
+	for i = 1, 1000 do
+		deltas[PREFIX .. "-test-inc-multi-many-" .. i] = i
+	end
+	values = client:inc_multi(deltas, 0, 60, true)
+	for i = 1, 1000 do
+		assert(values[PREFIX .. "-test-inc-multi-many-" .. i] == 0)
+	end
+	values = client:inc_multi(deltas, 0, 60, true)
+	for i = 1, 1000 do
+		assert(values[PREFIX .. "-test-inc-multi-many-" .. i] == i)
+	end
+
+	client:close()
+end
+
+function testCounter ()
+	local client = memcached.open()
+	assert(client)
+	local key1, key2 = PREFIX .. "-test-counter-1", PREFIX .. "-test-counter-2"
+	local counter1 = client:counter(key1, 0, 0, 60)
+	local counter2 = client:counter(key2, 0, 10)
+	assert(string.match(tostring(counter1), "^memcached.counter"))
+
+	-- Accumulate locally
+	counter1:inc(5)
+	counter1:dec(2)
+	counter2:inc(3)
+	assert(client:get(key1) == nil)
+	assert(counter2:get(true) == 3)
+
+	-- Flush all counters of the instance
+	assert(counter1:flush() == 3)
+	assert(client:inc(key1, 0) == 3)
+	assert(client:inc(key2, 0) == 3)
+	assert(counter1:get() == 3)
+
+	-- Threshold
+	counter2:inc(9)
+	assert(client:inc(key2, 0) == 3)
+	counter2:inc(1)
+	assert(client:inc(key2, 0) == 13)
+
+	-- Flush on close
+	counter1:inc(4)
+	client:close()
+	client = memcached.open()
+	assert(client:inc(key1, 0) == 7)
+
+	-- Use after close
+	client:close()
+	local counter3 = client:counter(key1, 0, 0)
+	local ok, err = pcall(counter1.flush, counter1)
+	assert(not ok and string.match(err, "closed"))
+	ok, err = pcall(counter3.get, counter3)
+	assert(not ok and string.match(err, "closed"))
+	counter3:inc(1)
+	counter1, counter3 = nil, nil
+	collectgarbage()
+end
+
+function testShardedCounter ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-sharded-counter"
+	for i = 1, 8 do
+		client:set(key .. ":" .. i, nil)
+	end
+	local counter = client:sharded_counter(key, 8, 60)
+	assert(string.match(tostring(counter), "^memcached.shardedcounter"))
+	assert(counter:get() == 0)
+	for i = 1, 100 do
+		counter:inc(2)
+	end
+	assert(counter:get() == 200)
+	local total = 0
+	for i = 1, 8 do
+		total = total + (client:inc(key .. ":" .. i, 0) or 0)
+	end
+	assert(total == 200)
+	client:close()
+end
+
+function testRateLimit ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-rate-limit-" .. os.time()
+	local allowed = 0
+	for i = 1, 100 do
+		local ok, remaining = client:rate_limit(key, 50, 60)
+		assert(remaining >= 0)
+		if ok then
+			allowed = allowed + 1
+		end
+	end
+	assert(allowed > 0 and allowed <= 50)
+	assert(client:rate_limit(key, 50, 60) == false)
+	client:close()
+end
+
+function testLock ()
+	local client = memcached.open()
+	assert(client)
+	local key = PREFIX .. "-test-lock"
+	client:set(key, nil)
+	local lock, token = client:lock(key, 10)
+	assert(lock and token == lock:token())
+	assert(string.match(tostring(lock), "^memcached.lock"))
+	assert(client:lock(key, 10, 50) == nil)
+	assert(lock:release())
+	assert(not lock:release())
+
+	-- Lost lock
+	local lock2, token2 = client:lock(key, 10)
+	assert(lock2 and token2 ~= token)
+	client:set(key, nil)
+	local lock3 = client:lock(key, 10)
+	assert(lock3)
+	assert(not lock2:release())
+	assert(lock3:release())
+	client:close()
+end
+
+function testNamespace ()
+	local client = memcached.open()
+	assert(client)
+	local ns = client:namespace(PREFIX .. "-test-namespace", 0)
+	assert(string.match(tostring(ns), "^memcached.namespace"))
+	local key = "key"
+	local value = "test-value"
+	assert(ns:set(key, value))
+	assert(ns:get(key) == value)
+	assert(client:get(key) == nil)
+	assert(ns:inc("counter", 1, 5) == 5)
+
+	-- Invalidate
+	local other = client:namespace(PREFIX .. "-test-namespace", 0)
+	assert(other:get(key) == value)
+	local generation = ns:invalidate()
+	assert(math.type(generation) == "integer")
+	assert(ns:get(key) == nil)
+	assert(other:get(key) == nil)
+	assert(ns:add(key, value))
+	assert(other:get(key) == value)
+
+	client:close()
+end
+
 function testFlush ()
 	local client = memcached.open()
 	assert(client)
@@ -293,10 +1036,34 @@ end
 testCodec()
 testOpenClose()
 testSetGet()
+testPrefix()
+testKeys()
 testExpiration()
+testJitter()
+testXFetch()
 testCas()
 testAddReplace()
+testUpdate()
 testIncDec()
+testTouch()
+testCanonical()
+testDedup()
+testSetDelta()
+testAppend()
+testSetAsync()
+testBatch()
+testLoader()
+testPrefetch()
+testMetrics()
+testSlowLog()
+testHotKeys()
+testList()
+testIncMulti()
+testCounter()
+testShardedCounter()
+testRateLimit()
+testLock()
+testNamespace()
 if os.getenv("MEMCACHED_TEST_FLUSH") then
 	testFlush()  -- only run flush test if environment variable is set
 end